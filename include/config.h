@@ -26,6 +26,15 @@
 # define SHOW_MAP false // shows the tile values in the console - may be not super nice if the map is big
 #endif
 
+#define TEXTURE_CACHE_SIZE 64 // how much different textures can be shared at once, see LoadTextureCached()
+#define ATLAS_PAGE_SIZE 2048 // width/height of the atlas textures (px)
+#define ATLAS_PADDING 1 // space between two spritesheets in an atlas (px)
+#define SPRITE_BATCH_SIZE 4096 // how much sprites can be queued between BeginSpriteBatch() and FlushSpriteBatch(), the next ones are dropped
+#define MAP_CHUNK_SIZE 16 // maps are pre-rendered in chunks of MAP_CHUNK_SIZE*MAP_CHUNK_SIZE tiles
+#define WORLD_MEMORY_BUDGET (32 * 1024 * 1024) // bytes of map tiles and chunk textures a World keeps loaded (current map and neighbours excepted)
+
 #define SCALING_FACTOR 5
 #define SCREEN_WIDTH 320
 #define SCREEN_HEIGHT 288
+#define RENDER_WIDTH GAMEBOY_SCREEN_WIDTH   // the world is drawn at this resolution (eg. GBA_SCREEN_WIDTH), then scaled up to the window
+#define RENDER_HEIGHT GAMEBOY_SCREEN_HEIGHT
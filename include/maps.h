@@ -13,13 +13,121 @@ typedef enum {
     MAP_COUNT,
 } MapID;
 
-static const char *mapTable[] = {
-    [MAP_PALLET_TOWN]   = "assets/data/maps/pallet-town.dat",
-    [MAP_NATIONAL_PARK] = "assets/data/maps/national-park.dat",
+static const char *const mapTable[] = {
+    [MAP_PALLET_TOWN]   = "assets/data/maps/pallet-town.map",
+    [MAP_NATIONAL_PARK] = "assets/data/maps/national-park.map",
 // Ice Path
-    [MAP_ICE_PATH_1F]  = "assets/data/maps/ice-path-1F.dat",
-    [MAP_ICE_PATH_B1F] = "assets/data/maps/ice-path-B1F.dat",
-    [MAP_ICE_PATH_B3F] = "assets/data/maps/ice-path-B3F.dat",
-    [MAP_ICE_PATH_B2F_BLACKTHORN] = "assets/data/maps/ice-path-B2F-blackthorn.dat",
-    [MAP_ICE_PATH_B2F_MAHOGANY]   = "assets/data/maps/ice-path-B2F-mahogany.dat",
+    [MAP_ICE_PATH_1F]  = "assets/data/maps/ice-path-1F.map",
+    [MAP_ICE_PATH_B1F] = "assets/data/maps/ice-path-B1F.map",
+    [MAP_ICE_PATH_B3F] = "assets/data/maps/ice-path-B3F.map",
+    [MAP_ICE_PATH_B2F_BLACKTHORN] = "assets/data/maps/ice-path-B2F-blackthorn.map",
+    [MAP_ICE_PATH_B2F_MAHOGANY]   = "assets/data/maps/ice-path-B2F-mahogany.map",
+};
+
+// How two maps are connected: a seam is a shared border, the maps are drawn next to each other
+// and walking across it changes map, a warp (door, ladder, hole) only preloads the destination
+typedef enum {
+    CONNECTION_NORTH,   // 'to' is above 'from'
+    CONNECTION_SOUTH,   // 'to' is below 'from'
+    CONNECTION_WEST,    // 'to' is left of 'from'
+    CONNECTION_EAST,    // 'to' is right of 'from'
+    CONNECTION_WARP,
+} ConnectionType;
+
+typedef struct {
+    MapID from;
+    MapID to;
+    ConnectionType type;
+    int offset;         // seams only: tiles 'to' is shifted along the border (right for north/south, down for west/east)
+} MapConnection;
+
+// Animated tiles: wherever a map of the tileset has 'tile', frames[0], frames[1]... are drawn in turn,
+// the map data is not touched (see UpdateMapAnimations())
+#define TILE_ANIMATION_MAX_FRAMES 8
+
+typedef struct {
+    const char *tilesetPath;
+    int tile;           // tile ID in the maps
+    int frameDuration;  // ticks (UpdateWorld() calls) per frame
+    int framesNumber;
+    int frames[TILE_ANIMATION_MAX_FRAMES];  // tile IDs of the tileset
+} TileAnimation;
+
+static const TileAnimation tileAnimations[] = {
+// tileset-23: the two flower tiles swap, so neighbouring flowers sway in opposite directions
+    {"assets/sprites/tilesets/tileset-23.png", 11, 16, 2, {11, 12}},
+    {"assets/sprites/tilesets/tileset-23.png", 12, 16, 2, {12, 11}},
+};
+
+// What a tile of a tileset is, for the movement checks (see GetWorldStep()), packed in a byte per map tile
+typedef enum {
+    TILE_SOLID       = 1 << 0,  // trees, walls, rocks...
+    TILE_WATER       = 1 << 1,  // can't be walked on
+    TILE_GRASS       = 1 << 2,  // wild pokemons
+    TILE_WARP        = 1 << 3,  // doors, ladders, holes
+    TILE_COUNTER     = 1 << 4,  // can't be walked on, but talked across
+    TILE_LEDGE_DOWN  = 1 << 5,  // can only be jumped over, in that direction
+    TILE_LEDGE_LEFT  = 1 << 6,
+    TILE_LEDGE_RIGHT = 1 << 7,
+} TileAttribute;
+
+// Tiles of a tileset that are not walkable ground, 'firstTile' to 'lastTile' (included).
+// GetWorldStep() reads one tile per step: the mover walks 16 px steps on 8 px tiles, so only the tile
+// under its position, one quarter of each 2x2 metatile, is checked. The table must mark every quarter
+// of a blocking (solid, water...) metatile: a quarter without entry makes the whole metatile walkable
+// when it is the one read, and a metatile mixing blocking and walkable quarters (e.g. the half walls
+// of tileset-29) blocks or not depending on which quarter the mover lands on
+typedef struct {
+    const char *tilesetPath;
+    int firstTile;
+    int lastTile;
+    int attributes;     // TileAttribute bits
+} TileAttributes;
+
+static const TileAttributes tileAttributes[] = {
+// tileset-23 (national park)
+    {"assets/sprites/tilesets/tileset-23.png",  0,  3, TILE_SOLID},    // tree
+    {"assets/sprites/tilesets/tileset-23.png", 13, 16, TILE_SOLID},
+    {"assets/sprites/tilesets/tileset-23.png", 26, 29, TILE_SOLID},
+    {"assets/sprites/tilesets/tileset-23.png", 39, 42, TILE_SOLID},
+    {"assets/sprites/tilesets/tileset-23.png",  4,  5, TILE_SOLID},    // rock in the pond
+    {"assets/sprites/tilesets/tileset-23.png", 17, 18, TILE_SOLID},
+    {"assets/sprites/tilesets/tileset-23.png", 46, 46, TILE_SOLID},    // pond border
+    {"assets/sprites/tilesets/tileset-23.png",  6,  6, TILE_WATER},
+    {"assets/sprites/tilesets/tileset-23.png", 19, 19, TILE_WATER},
+    {"assets/sprites/tilesets/tileset-23.png", 30, 31, TILE_GRASS},    // tall grass
+    {"assets/sprites/tilesets/tileset-23.png", 43, 45, TILE_GRASS},
+// tileset-29 (ice path), the speckled and striped ice is the floor
+    {"assets/sprites/tilesets/tileset-29.png",   6,   7, TILE_SOLID},    // boulder
+    {"assets/sprites/tilesets/tileset-29.png",  22,  23, TILE_SOLID},
+    {"assets/sprites/tilesets/tileset-29.png",  96, 105, TILE_SOLID},    // ice rocks and cave walls
+    {"assets/sprites/tilesets/tileset-29.png", 108, 109, TILE_SOLID},
+    {"assets/sprites/tilesets/tileset-29.png", 112, 121, TILE_SOLID},
+    {"assets/sprites/tilesets/tileset-29.png", 124, 125, TILE_SOLID},
+    {"assets/sprites/tilesets/tileset-29.png", 128, 137, TILE_SOLID},
+    {"assets/sprites/tilesets/tileset-29.png", 140, 141, TILE_SOLID},
+    {"assets/sprites/tilesets/tileset-29.png", 144, 156, TILE_SOLID},
+    {"assets/sprites/tilesets/tileset-29.png", 160, 165, TILE_SOLID},
+    {"assets/sprites/tilesets/tileset-29.png", 168, 171, TILE_SOLID},
+    {"assets/sprites/tilesets/tileset-29.png", 173, 173, TILE_SOLID},
+    {"assets/sprites/tilesets/tileset-29.png", 176, 181, TILE_SOLID},
+    {"assets/sprites/tilesets/tileset-29.png",  10,  11, TILE_WARP},     // ladder up
+    {"assets/sprites/tilesets/tileset-29.png",  26,  27, TILE_WARP},
+    {"assets/sprites/tilesets/tileset-29.png",  42,  43, TILE_WARP},     // ladder down
+    {"assets/sprites/tilesets/tileset-29.png",  58,  59, TILE_WARP},
+    {"assets/sprites/tilesets/tileset-29.png", 110, 111, TILE_WARP},     // hole
+    {"assets/sprites/tilesets/tileset-29.png", 126, 127, TILE_WARP},
+    {"assets/sprites/tilesets/tileset-29.png", 142, 143, TILE_WARP},     // stairs
+    {"assets/sprites/tilesets/tileset-29.png", 158, 159, TILE_WARP},
+    {"assets/sprites/tilesets/tileset-29.png",  80,  81, TILE_WARP},     // exit mat
+};
+
+// Connections go both ways, see GetMapNeighbours()
+static const MapConnection mapConnections[] = {
+// Ice Path
+    {MAP_ICE_PATH_1F,           MAP_ICE_PATH_B1F,            CONNECTION_WARP, 0},
+    {MAP_ICE_PATH_B1F,          MAP_ICE_PATH_B2F_MAHOGANY,   CONNECTION_WARP, 0},
+    {MAP_ICE_PATH_B1F,          MAP_ICE_PATH_B2F_BLACKTHORN, CONNECTION_WARP, 0},
+    {MAP_ICE_PATH_B2F_MAHOGANY, MAP_ICE_PATH_B3F,            CONNECTION_WARP, 0},
+    {MAP_ICE_PATH_B3F,          MAP_ICE_PATH_B2F_BLACKTHORN, CONNECTION_WARP, 0},
 };
@@ -1,6 +1,11 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <pthread.h>
 #include <raylib.h>
 #include "abilities.h"
 #include "moves.h"
@@ -9,6 +14,7 @@
 // Typedef ----------------------------------------------------
 typedef uint8_t u8;     //    256
 typedef uint16_t u16;   // 65 535
+typedef uint32_t u32;   // 4 294 967 295
 
 // Macros -----------------------------------------------------
 #define YELLOW_PRINT printf("\033[0;33m")
@@ -19,6 +25,12 @@ typedef uint16_t u16;   // 65 535
 #define CYAN_PRINT printf("\033[0;36m")
 #define NO_COLOR printf("\033[0m")
 
+#define TEXTURE_PATH_LENGTH 128 // max length of the paths of cached textures (with '\0')
+#define MAP_PATH_LENGTH 64      // max length of the paths stored in map files (with '\0')
+#define MAP_FILE_MAGIC "PKMP"   // first bytes of a binary map file
+#define MAP_FILE_VERSION 3
+#define MAP_EMPTY_TILE 0xFFFF   // no tile there (overlay layers), stored as 0xFF in 8-bit tile IDs (see GetMapTile())
+
 // Enums ------------------------------------------------------
 typedef enum {
     NO_TYPE,
@@ -42,17 +54,55 @@ typedef enum {
     FAIRY
 } Type;
 
+typedef enum {
+    DIRECTION_DOWN,
+    DIRECTION_UP,
+    DIRECTION_LEFT,
+    DIRECTION_RIGHT,
+} Direction;
+
+// How the tiles of a binary map file are stored (MapFileHeader.encoding)
+typedef enum {
+    MAP_ENCODING_RAW,           // as in Map.tiles, used in place once memory-mapped
+    MAP_ENCODING_LAYERS,        // layer by layer, a MapLayerEncoding byte then the layer, decoded at load time
+} MapEncoding;
+
+typedef enum {
+    MAP_LAYER_RAW,              // width * height tile IDs (of MapFileHeader.tileBytes bytes each)
+    MAP_LAYER_RLE,              // control bytes: 0-127 -> 1-128 tile IDs follow, 128-255 -> the next tile ID 2-129 times
+    MAP_LAYER_PALETTE,          // palette size (0 for 256), the palette's tile IDs, then the palette indices
+                                // packed on the fewest bits that fit, low bits first
+} MapLayerEncoding;
+
 
 
 // Structs ----------------------------------------------------
 typedef struct {
     Texture2D spritesheet;
-    Rectangle *frames;
-    u8 spriteNumber;
-    u8 index;
+    Rectangle region;           // part of the spritesheet holding the frames (all of it, or its atlas slot)
+    u8 spriteWidth;             // frames are laid out on a grid of spriteWidth*spriteHeight px cells,
+    u8 spriteHeight;            // see GetSpriteFrame()
+    u16 columns;                // how much cells per row
+    u8 spriteOffset;            // how much cells to skip on the first row
+    u16 spriteNumber;           // a tileset can have more than 256 tiles
+    u16 index;
     u16 *animation; // list of frames to make a sprite animation, as pokemon battle sprites have often 100+ frames of animation yet only have 30ish sprites on the spritesheet
 } Sprite;
 
+// Spritesheets packed together by MakeAtlas()
+typedef struct {
+    char path[TEXTURE_PATH_LENGTH]; // the spritesheet file it was loaded from
+    u16 page;                   // which atlas page holds it
+    Rectangle rect;             // where it is on the page (px)
+} AtlasEntry;
+
+typedef struct {
+    Texture2D *pages;
+    u16 pagesNumber;
+    AtlasEntry *entries;
+    u16 entriesNumber;
+} Atlas;
+
 typedef struct {
     Sprite redBlue;              // gen-1
     Sprite yellow;               // gen-2
@@ -101,17 +151,81 @@ typedef struct {
     MapID mapID;    // unique enum ID
 // Tileset
     Sprite tileset;
-    const char *tilesetPath;    // path to the tileset spritesheet
-    u8 tilesetSpritesNumber;    // tileset's number of sprites
+    char tilesetPath[MAP_PATH_LENGTH];  // path to the tileset spritesheet
+    u16 tilesetSpritesNumber;   // tileset's number of sprites
     u8 tileSize;               // tileset's tile size (px*px)
 // Map
     u8 width;                   // map width (tile-wise)
     u8 height;                  // map height (tile-wise)
     u8 layersNumber;            // how much layers the map have
     u16 tilesNumber;            // how much tiles the map have (width * height)
-    u8 ***tiles;                // tiles[layer][tileType]
+    u8 tileBytes;               // 1 (u8) or 2 (u16, the map uses tiles past the 255th) bytes per tile ID
+    u8 *tiles;                  // layer-major tile IDs of 'tileBytes' bytes, use GetMapTile()
+    u8 *attributes;             // TileAttribute bits of every tile (x, y), all layers merged, use GetMapTileAttributes()
+    u8 *tilesetAttributes;      // tile ID -> TileAttribute bits (see tileAttributes)
+    void *fileData;             // memory-mapped binary map file holding 'tiles' (NULL if they are allocated)
+    size_t fileSize;            // size of the memory-mapped file
+// Render cache
+    RenderTexture2D *chunks;    // chunks[layer][chunkY][chunkX], pre-rendered MAP_CHUNK_SIZE*MAP_CHUNK_SIZE tiles
+    bool *dirtyChunks;          // chunks to re-render on the next UpdateMapChunks()
+    u16 *chunkTiles;            // static tiles per chunk (not empty nor animated), a chunk without any has no texture
+    u16 *animatedCells;         // cells (y * width + x) showing an animated tile, chunk by chunk, drawn over the chunks
+    u32 *chunkAnimatedCells;    // the cells of chunk c are animatedCells[chunkAnimatedCells[c]..chunkAnimatedCells[c + 1]-1]
+    bool animatedCellsDirty;    // a cell became or stopped being animated, the list is rebuilt by UpdateMapChunks()
+// Animated tiles
+    u16 *tileFrames;            // tile ID -> tile ID drawn this frame, NULL if the tileset has no animated tiles
+    u8 *animations;             // indices in tileAnimations of the tileset's animations
+    u8 animationsNumber;
+    u8 chunksX;                 // how much chunks per row
+    u8 chunksY;                 // how much chunks per column
 } Map;
 
+// Binary map file (.map): this header followed by the tiles, either raw in the same layer-major order
+// as Map.tiles, so they are used in place once the file is memory-mapped, or encoded (see MapEncoding)
+typedef struct {
+    char magic[4];              // MAP_FILE_MAGIC, without the '\0'
+    u8 version;                 // MAP_FILE_VERSION
+    u8 width;                   // map width (tile-wise)
+    u8 height;                  // map height (tile-wise)
+    u8 layersNumber;            // how much layers the map have
+    u16 tilesetSpritesNumber;   // tileset's number of sprites
+    u8 tileSize;                // tileset's tile size (px*px)
+    u8 tileBytes;               // bytes per tile ID (1 or 2, native byte order)
+    u8 encoding;                // MapEncoding of the tiles
+    u8 reserved[3];             // keeps the tiles 16-bytes aligned
+    char tilesetPath[MAP_PATH_LENGTH];  // path to the tileset spritesheet
+} MapFileHeader;
+
+// Map loaded in the background, see LoadMapAsync()
+typedef struct {
+    pthread_t thread;
+    char path[TEXTURE_PATH_LENGTH];
+    Map map;                    // CPU side of the map, filled by the worker
+    Image tilesetImage;         // decoded by the worker, uploaded by FinishMapLoad()
+    bool succeeded;             // written by the worker before 'done'
+    atomic_bool done;
+} MapLoad;
+
+// Map of a World, see UpdateWorld()
+typedef struct {
+    Map map;                    // valid if 'resident'
+    MapLoad *load;              // not NULL while loading in the background
+    bool resident;
+    bool failed;                // could not be loaded, not tried again
+    bool seam;                  // resident and sharing a border with the current map
+    Vector2 origin;             // seams: top-left tile of the map, in the current map tiles
+    u32 lastUsed;               // last UpdateWorld() the map was the current map or one of its neighbours
+} WorldMap;
+
+// The current map and its neighbours (mapConnections) stay loaded, the other maps are freed
+// from the least recently used when they take more than the memory budget
+typedef struct {
+    WorldMap maps[MAP_COUNT];   // indexed by MapID
+    MapID current;
+    size_t memoryBudget;        // bytes of tiles and chunk textures
+    u32 tick;                   // UpdateWorld() calls
+} World;
+
 // Player -----------------------------------------------------
 typedef struct {
     Vector2 position;
@@ -120,11 +234,122 @@ typedef struct {
 } Player;
 
 // Functions --------------------------------------------------
-Sprite MakeSprite(const char *spritesheetPath, u8 framesNumber, u8 spriteWidth, u8 spriteHeight, u8 frameOffset);
+Texture2D LoadTextureCached(const char *fileName);
+Texture2D LoadTextureFromImageCached(const char *fileName, Image image);
+void UnloadTextureCached(Texture2D texture);
+
+Sprite MakeSprite(const char *spritesheetPath, u16 framesNumber, u8 spriteWidth, u8 spriteHeight, u8 frameOffset);
+Sprite MakeSpriteFromTexture(Texture2D spritesheet, u16 framesNumber, u8 spriteWidth, u8 spriteHeight, u8 frameOffset);
+Atlas MakeAtlas(const char **spritesheetPaths, u16 spritesheetsNumber, int pageSize);
+Sprite MakeSpriteFromAtlas(Atlas atlas, const char *spritesheetPath, u16 framesNumber, u8 spriteWidth, u8 spriteHeight, u8 frameOffset);
 void MakeMap(Map *map, const char *mapData);
+bool LoadMapData(Map *map, const char *mapData);
+bool SaveMapBinary(const Map *map, const char *fileName, bool compress);
+MapLoad *LoadMapAsync(const char *mapData);
+bool IsMapLoadDone(const MapLoad *load);
+bool FinishMapLoad(MapLoad *load, Map *map);
+void CancelMapLoad(MapLoad *load);
+void BakeMapChunks(Map *map);
+void UpdateMapChunks(Map *map);
+void UpdateMapAnimations(Map *map, u32 tick);
+void SetMapTile(Map *map, u8 layerIndex, u8 x, u8 y, u16 tile);
+u8 GetWorldTileAttributes(World *world, int x, int y);
+u8 GetWorldStep(World *world, Vector2 position, Direction direction, int stepSize, u8 scalingFactor);
+u8 GetMapNeighbours(MapID mapID, MapID *neighbours, ConnectionType *types, u8 capacity);
+bool MakeWorld(World *world, MapID start, size_t memoryBudget);
+Vector2 UpdateWorld(World *world, Vector2 focus, u8 scalingFactor);
+bool WarpWorld(World *world, MapID mapID);
+Map *GetWorldMap(World *world);
 
-void DrawSprite(Sprite sprite, u8 frameIndex, u8 scalingFactor, Vector2 position);
+void DrawSprite(Sprite sprite, u16 frameIndex, u8 scalingFactor, Vector2 position);
+void BeginSpriteBatch(void);
+void SubmitSprite(Sprite sprite, u16 frameIndex, u8 scalingFactor, Vector2 position, u8 layer);
+void FlushSpriteBatchLayers(u8 lastLayer);
+void FlushSpriteBatch(void);
 void DrawMapLayer(Map map, u8 layerIndex, u8 scalingFactor);
+void DrawMapLayerView(Map map, u8 layerIndex, u8 scalingFactor, Rectangle view);
+void DrawMapLayerChunks(Map map, u8 layerIndex, u8 scalingFactor, Rectangle view);
+void DrawMapLayers(Map map, u8 scalingFactor, Rectangle view);
+Rectangle GetCameraViewRec(Camera2D camera, int width, int height);
+Rectangle DrawRenderTarget(RenderTexture2D target, int screenWidth, int screenHeight);
+void DrawWorldLayer(World *world, u8 layerIndex, u8 scalingFactor, Rectangle view);
+void DrawWorld(World *world, u8 scalingFactor, Rectangle view);
 
 void FreeSprite(Sprite sprite);
+void FreeAtlas(Atlas atlas);
 void FreeMap(Map map);
+void FreeMapData(Map *map);
+void FreeWorld(World *world);
+
+// Inline -----------------------------------------------------
+// @info Source rectangle of a frame on the spritesheet, computed from the sprite grid
+static inline Rectangle GetSpriteFrame(const Sprite *sprite, u16 frameIndex)
+{
+    int i = frameIndex % sprite->columns;
+    int j = frameIndex / sprite->columns;
+
+    // TODO: rework the "offset" thing because it only works for x-axis offset, and not a sprite offset per-se
+    return (Rectangle) {
+        sprite->region.x + (sprite->spriteOffset + i) * sprite->spriteWidth,
+        sprite->region.y + j * sprite->spriteHeight,
+        sprite->spriteWidth,
+        sprite->spriteHeight,
+    };
+}
+
+// @info Index of the tile (x, y) of a layer in 'map->tiles'
+static inline int GetMapTileIndex(const Map *map, u8 layerIndex, u8 x, u8 y)
+{
+    return (layerIndex * map->height + y) * map->width + x;
+}
+
+/*  @info World position (px, drawn with 'scalingFactor') of the top-left corner of the tile (x, y) of a map:
+ *        DrawSprite() centers the tile on (x*F - tileSize, y*F - tileSize), F being tileSize * scalingFactor,
+ *        so it covers [x*F - edge, x*F - edge + F[ on x (same on y) */
+static inline Vector2 GetMapTileWorldPosition(const Map *map, float x, float y, u8 scalingFactor)
+{
+    int F = map->tileSize * scalingFactor;
+    float edge = map->tileSize + F/2.0f;
+    return (Vector2) {x * F - edge, y * F - edge};
+}
+
+// @info Tile of a map under a world position (px, drawn with 'scalingFactor'), can be outside of the map
+static inline Vector2 GetWorldMapTile(const Map *map, Vector2 position, u8 scalingFactor)
+{
+    int F = map->tileSize * scalingFactor;
+    Vector2 origin = GetMapTileWorldPosition(map, 0, 0, scalingFactor);
+    return (Vector2) {floorf((position.x - origin.x) / F), floorf((position.y - origin.y) / F)};
+}
+
+// @info What a tile of the map is (TileAttribute bits), outside of the map is solid
+static inline u8 GetMapTileAttributes(const Map *map, int x, int y)
+{
+    if ((x < 0) || (y < 0) || (x >= map->width) || (y >= map->height)) return TILE_SOLID;
+    return map->attributes[y * map->width + x];
+}
+
+// @info One step towards 'direction' (e.g. {0, 1} for DIRECTION_DOWN)
+static inline Vector2 GetDirectionVector(Direction direction)
+{
+    static const Vector2 vectors[] = {
+        [DIRECTION_DOWN]  = {0, 1},
+        [DIRECTION_UP]    = {0, -1},
+        [DIRECTION_LEFT]  = {-1, 0},
+        [DIRECTION_RIGHT] = {1, 0},
+    };
+    return vectors[direction];
+}
+
+// @info Overlay layers (roofs, tree tops) are mostly empty: nothing is drawn for MAP_EMPTY_TILE
+static inline bool IsMapTileEmpty(u16 tile)
+{
+    return tile == MAP_EMPTY_TILE;
+}
+
+// @info Tile ID of the tile (x, y) of a layer, or MAP_EMPTY_TILE (whatever the size of the map tile IDs)
+static inline u16 GetMapTile(const Map *map, u8 layerIndex, u8 x, u8 y)
+{
+    int i = GetMapTileIndex(map, layerIndex, x, y);
+    if (map->tileBytes == 2) return ((const u16 *)map->tiles)[i];
+    return (map->tiles[i] == 0xFF) ? MAP_EMPTY_TILE : map->tiles[i];
+}
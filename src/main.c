@@ -22,31 +22,52 @@ int main(void) {
     SetTargetFPS(60);
 
     // Initialization -----------------------------------------
+    // the maps connected to the current one are loading in the background, so warping to them does not hitch
+    World world;
+    //MapID startMapID = MAP_PALLET_TOWN;
+    MapID startMapID = MAP_ICE_PATH_B1F;
+    if (!MakeWorld(&world, startMapID, WORLD_MEMORY_BUDGET)) {
+        FreeWorld(&world);
+        CloseWindow();
+        return 1;
+    }
+    MapID warpMapID = MAP_COUNT;    // map to warp to once it is loaded (MAP_COUNT: none)
+    int warpIndex = 0;              // which neighbour the next warp goes to
+
+    // overworld and battle spritesheets share one texture, so they are drawn in the same batch
+    const char *spritesheets[] = {
+        "assets/sprites/CRYSTAL/npc/player_overworld.png",
+        "assets/sprites/BW/pokemon/metang-82x64.png",
+        "assets/sprites/BW/pokemon/rayquaza-110x97.png",
+        "assets/sprites/BW/pokemon/genesect-62x70.png",
+    };
+    Atlas atlas = MakeAtlas(spritesheets, sizeof(spritesheets) / sizeof(spritesheets[0]), ATLAS_PAGE_SIZE);
+
     Player player = {
-        .position.x = 0.0f,
-        .position.y = 0.0f,
-        .owSprites = MakeSprite("assets/sprites/CRYSTAL/npc/player_overworld.png", 10, 16, 16, 0)
+        .position.x = 32.0f,    // on the ice floor of the start map, next to its top-left rock
+        .position.y = 32.0f,
+        .owSprites = MakeSpriteFromAtlas(atlas, "assets/sprites/CRYSTAL/npc/player_overworld.png", 10, 16, 16, 0)
     };
 
+    // the world is drawn 1:1 at RENDER_WIDTH*RENDER_HEIGHT, then scaled up once to the window
+    RenderTexture2D target = LoadRenderTexture(RENDER_WIDTH, RENDER_HEIGHT);
+    SetTextureFilter(target.texture, TEXTURE_FILTER_POINT);
+
     Camera2D camera = {
-        .offset = (Vector2){(float)screenWidth/2, (float)screenHeight/2},
+        .offset = (Vector2){(float)RENDER_WIDTH/2, (float)RENDER_HEIGHT/2},
         .target = (Vector2){0, 0},
         .rotation = 0.0f,
         .zoom = 1.0f,
     };
 
 
-    Sprite metang = MakeSprite("assets/sprites/BW/pokemon/metang-82x64.png", 32, 82, 64, 0);
-    Sprite rayquaza = MakeSprite("assets/sprites/BW/pokemon/rayquaza-110x97.png", 28, 110, 97, 0);
-    Sprite genesect = MakeSprite("assets/sprites/BW/pokemon/genesect-62x70.png", 44, 62, 70, 0);
+    Sprite metang = MakeSpriteFromAtlas(atlas, "assets/sprites/BW/pokemon/metang-82x64.png", 32, 82, 64, 0);
+    Sprite rayquaza = MakeSpriteFromAtlas(atlas, "assets/sprites/BW/pokemon/rayquaza-110x97.png", 28, 110, 97, 0);
+    Sprite genesect = MakeSpriteFromAtlas(atlas, "assets/sprites/BW/pokemon/genesect-62x70.png", 44, 62, 70, 0);
 
     int framesSpeed = 8;
     int framesCounter = 0;
 
-    Map currentMap;
-    //MakeMap(&currentMap, mapTable[MAP_PALLET_TOWN]);
-    MakeMap(&currentMap, mapTable[MAP_ICE_PATH_B1F]);
-
     // Main game loop -----------------------------------------
     while (!WindowShouldClose())
     {
@@ -70,20 +91,42 @@ int main(void) {
 
 
         // Controls -------------------------------------------
+        bool walking = true;
+        Direction direction = DIRECTION_DOWN;
         if (IsKeyPressed(KEY_LEFT)) {
-            player.position.x -= 16 * SCALING_FACTOR;
+            direction = DIRECTION_LEFT;
             player.owSprites.index = 6;
         } else if (IsKeyPressed(KEY_RIGHT)) {
-            player.position.x += 16 * SCALING_FACTOR;
+            direction = DIRECTION_RIGHT;
             player.owSprites.index = 8;
         } else if (IsKeyPressed(KEY_DOWN)) {
-            player.position.y += 16 * SCALING_FACTOR;
+            direction = DIRECTION_DOWN;
             player.owSprites.index = 1;
         } else if (IsKeyPressed(KEY_UP)) {
-            player.position.y -= 16 * SCALING_FACTOR;
+            direction = DIRECTION_UP;
             player.owSprites.index = 4;
+        } else {
+            walking = false;
+        }
+        if (walking) {
+            // the player turns even when blocked, and jumps two steps over a ledge
+            u8 steps = GetWorldStep(&world, player.position, direction, 16, 1);
+            Vector2 step = GetDirectionVector(direction);
+            player.position.x += step.x * 16 * steps;
+            player.position.y += step.y * 16 * steps;
         }
 
+        if (IsKeyPressed(KEY_N)) {
+            MapID neighbours[MAP_COUNT];
+            u8 neighboursNumber = GetMapNeighbours(world.current, neighbours, NULL, MAP_COUNT);
+            if (neighboursNumber > 0) warpMapID = neighbours[warpIndex++ % neighboursNumber];
+        }
+        if ((warpMapID != MAP_COUNT) && WarpWorld(&world, warpMapID)) warpMapID = MAP_COUNT;
+
+        // walking across a seam moves everything into the next map's coordinates
+        Vector2 shift = UpdateWorld(&world, player.position, 1);
+        player.position.x += shift.x;
+        player.position.y += shift.y;
         camera.target = player.position;
 
         // Debug ----------------------------------------------
@@ -94,30 +137,40 @@ int main(void) {
         #endif
 
         // Draw -----------------------------------------------
-        BeginDrawing();
+        BeginTextureMode(target);
             ClearBackground(BLACK);
 
             BeginMode2D(camera);
-            // draw background tiles
-            DrawMapLayer(currentMap, 0, SCALING_FACTOR);
             //DrawSprite(map.tileset, 6, u8 scalingFactor, Vector2 position)
 
-            //DrawSprite(metang, metang.index, SCALING_FACTOR, (Vector2) {(float)screenWidth/4, (float)screenHeight/4});
-            //DrawSprite(rayquaza, rayquaza.index, SCALING_FACTOR, (Vector2) {(float)screenWidth/4*3, (float)screenHeight/4*3});
-            //DrawSprite(genesect, genesect.index, SCALING_FACTOR, (Vector2) {(float)screenWidth/2, (float)screenHeight/2});
-            DrawSprite(player.owSprites, player.owSprites.index, SCALING_FACTOR, player.position);
+            // sprites of layer N are drawn over the map layer N, under the roofs/tree tops of the next layers
+            BeginSpriteBatch();
+            //SubmitSprite(metang, metang.index, 1, (Vector2) {(float)RENDER_WIDTH/4, (float)RENDER_HEIGHT/4}, 0);
+            //SubmitSprite(rayquaza, rayquaza.index, 1, (Vector2) {(float)RENDER_WIDTH/4*3, (float)RENDER_HEIGHT/4*3}, 0);
+            //SubmitSprite(genesect, genesect.index, 1, (Vector2) {(float)RENDER_WIDTH/2, (float)RENDER_HEIGHT/2}, 0);
+            SubmitSprite(player.owSprites, player.owSprites.index, 1, player.position, 0);
+            DrawWorld(&world, 1, GetCameraViewRec(camera, RENDER_WIDTH, RENDER_HEIGHT));
 
 
             EndMode2D();
+        EndTextureMode();
 
+        BeginDrawing();
+            ClearBackground(BLACK);
+            Rectangle screen = DrawRenderTarget(target, screenWidth, screenHeight);
+            (void)screen;   // only the debug overlay uses it
 
             #ifdef DEBUG
-                // grid
+                // grid (the world is scaled up by 'scale' on the window)
+                Map *currentMap = GetWorldMap(&world);
+                float scale = screen.width / RENDER_WIDTH;
+                float centerX = screen.x + screen.width/2 + scale*8;
+                float centerY = screen.y + screen.height/2 + scale*8;
                  for (int i = 0; i < 20; i++) {
-                    DrawLine(screenWidth/2 - (currentMap.tileSize*i*SCALING_FACTOR*2) + SCALING_FACTOR*8, 0, screenWidth/2 - (currentMap.tileSize*i*SCALING_FACTOR*2) + SCALING_FACTOR*8, screenHeight, BLUE);
-                    DrawLine(screenWidth/2 + (currentMap.tileSize*i*SCALING_FACTOR*2) + SCALING_FACTOR*8, 0, screenWidth/2 + (currentMap.tileSize*i*SCALING_FACTOR*2) + SCALING_FACTOR*8, screenHeight, BLUE);
-                    DrawLine(0, screenHeight/2 - (currentMap.tileSize*i*SCALING_FACTOR*2) + SCALING_FACTOR*8, screenWidth, screenHeight/2 - (currentMap.tileSize*i*SCALING_FACTOR*2) + SCALING_FACTOR*8, BLUE);
-                    DrawLine(0, screenHeight/2 + (currentMap.tileSize*i*SCALING_FACTOR*2) + SCALING_FACTOR*8, screenWidth, screenHeight/2 + (currentMap.tileSize*i*SCALING_FACTOR*2) + SCALING_FACTOR*8, BLUE);
+                    DrawLine(centerX - (currentMap->tileSize*i*scale*2), screen.y, centerX - (currentMap->tileSize*i*scale*2), screen.y + screen.height, BLUE);
+                    DrawLine(centerX + (currentMap->tileSize*i*scale*2), screen.y, centerX + (currentMap->tileSize*i*scale*2), screen.y + screen.height, BLUE);
+                    DrawLine(screen.x, centerY - (currentMap->tileSize*i*scale*2), screen.x + screen.width, centerY - (currentMap->tileSize*i*scale*2), BLUE);
+                    DrawLine(screen.x, centerY + (currentMap->tileSize*i*scale*2), screen.x + screen.width, centerY + (currentMap->tileSize*i*scale*2), BLUE);
                 }
                 // cross
                 /*
@@ -146,8 +199,10 @@ int main(void) {
 
     FreeSprite(rayquaza);
     FreeSprite(genesect);
+    FreeAtlas(atlas);
 
-    FreeMap(currentMap);
+    FreeWorld(&world);
+    UnloadRenderTexture(target);
 
 
     CloseWindow(); // Close window and OpenGL context
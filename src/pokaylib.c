@@ -1,9 +1,125 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>      // open
+#include <unistd.h>     // close
+#include <sys/mman.h>   // mmap
+#include <sys/stat.h>   // fstat
 #include <raylib.h>
+#include <rlgl.h>
 #include "pokaylib.h"
 #include "config.h"
 
+// Textures ---------------------------------------------------
+// Textures shared by path, so a spritesheet/tileset used by several sprites/maps is only loaded once
+typedef struct {
+    char path[TEXTURE_PATH_LENGTH];
+    Texture2D texture;
+    int references;             // 0 means the slot is free
+} CachedTexture;
+
+static CachedTexture textureCache[TEXTURE_CACHE_SIZE];
+
+// @info Takes a reference on the cached texture loaded from 'fileName', returns NULL if there is none
+static CachedTexture *FindCachedTexture(const char *fileName)
+{
+    for (int i = 0; i < TEXTURE_CACHE_SIZE; i++) {
+        if ((textureCache[i].references > 0) && (strcmp(textureCache[i].path, fileName) == 0)) {
+            textureCache[i].references++;
+            return &textureCache[i];
+        }
+    }
+    return NULL;
+}
+
+// @info Adds a freshly loaded texture to the cache (if it can) with one reference, returns false if it could not
+static bool CacheTexture(const char *fileName, Texture2D texture)
+{
+    if ((texture.id == 0) || (strlen(fileName) >= TEXTURE_PATH_LENGTH)) {
+        return false;
+    }
+
+    for (int i = 0; i < TEXTURE_CACHE_SIZE; i++) {
+        if (textureCache[i].references == 0) {
+            strcpy(textureCache[i].path, fileName);
+            textureCache[i].texture = texture;
+            textureCache[i].references = 1;
+            return true;
+        }
+    }
+
+    YELLOW_PRINT;
+    TraceLog(LOG_WARNING, "texture cache is full (%d), [%s] will not be shared", TEXTURE_CACHE_SIZE, fileName);
+    NO_COLOR;
+    return false;
+}
+
+// @info Takes one more reference on a texture from the cache (no-op if it is not cached)
+static Texture2D ReferenceCachedTexture(Texture2D texture)
+{
+    for (int i = 0; i < TEXTURE_CACHE_SIZE; i++) {
+        if ((textureCache[i].references > 0) && (textureCache[i].texture.id == texture.id)) {
+            textureCache[i].references++;
+            break;
+        }
+    }
+    return texture;
+}
+
+/*  @info Loads a texture, or returns the already loaded one with the same path
+ *        (must be unloaded with UnloadTextureCached(), once per load)
+ *  @param fileName - the relative path to the image file */
+Texture2D LoadTextureCached(const char *fileName)
+{
+    CachedTexture *cached = FindCachedTexture(fileName);
+    if (cached != NULL) {
+        return cached->texture;
+    }
+
+    Texture2D texture = LoadTexture(fileName);
+    CacheTexture(fileName, texture);
+
+    return texture;
+}
+
+/*  @info Same as LoadTextureCached(), but uploads an already decoded image if the texture
+ *        is not loaded yet (the image is not unloaded)
+ *  @param fileName - the path the image was loaded from, used as the cache key */
+Texture2D LoadTextureFromImageCached(const char *fileName, Image image)
+{
+    CachedTexture *cached = FindCachedTexture(fileName);
+    if (cached != NULL) {
+        return cached->texture;
+    }
+
+    Texture2D texture = LoadTextureFromImage(image);
+    CacheTexture(fileName, texture);
+
+    return texture;
+}
+
+// @info Releases a texture from LoadTextureCached(), it is unloaded once nothing uses it anymore
+void UnloadTextureCached(Texture2D texture)
+{
+    if (texture.id == 0) return;
+
+    for (int i = 0; i < TEXTURE_CACHE_SIZE; i++) {
+        if ((textureCache[i].references > 0) && (textureCache[i].texture.id == texture.id)) {
+            textureCache[i].references--;
+            if (textureCache[i].references == 0) {
+                UnloadTexture(textureCache[i].texture);
+            }
+            return;
+        }
+    }
+
+    UnloadTexture(texture);     // was not cached
+}
+
+// Sprites ----------------------------------------------------
 /*  @info Builds a frame array (or a single frame) for sprite/animated sprite
  *  @param spritesheetPath - the relative path to the spritesheet image file
  *  @param sprite - the sprite we want to make
@@ -11,7 +127,7 @@
  *  @param spriteWidth - the width of the sprite (must be the same for each frame)
  *  @param spriteHeight - the height of the sprite (must be the same for each frame)
  *  @param spriteOffset - how much sprite to skip (spritesheet-wise) until you get to the first frame of the sprite you want to make */
-Sprite MakeSprite(const char *spritesheetPath, u8 spriteNumber, u8 spriteWidth, u8 spriteHeight, u8 spriteOffset)
+Sprite MakeSprite(const char *spritesheetPath, u16 spriteNumber, u8 spriteWidth, u8 spriteHeight, u8 spriteOffset)
 {
     #ifdef DEBUG
         YELLOW_PRINT;
@@ -24,35 +140,37 @@ Sprite MakeSprite(const char *spritesheetPath, u8 spriteNumber, u8 spriteWidth,
     #endif
 
     // TODO: maybe extract 'spriteWidth' and 'spriteHeight' from the spritesheet name (e.g. metang-82x64.png)
+    return MakeSpriteFromTexture(LoadTextureCached(spritesheetPath), spriteNumber, spriteWidth, spriteHeight, spriteOffset);
+}
+
+/*  @info Same as MakeSpriteFromTexture(), for a spritesheet stored in a region of the texture (e.g. an atlas),
+ *        nothing is allocated: the frames are computed from the grid by GetSpriteFrame() */
+static Sprite MakeSpriteFromRegion(Texture2D texture, Rectangle region, u16 spriteNumber, u8 spriteWidth, u8 spriteHeight, u8 spriteOffset)
+{
+    //int lin = region.height / spriteHeight;
+    int col = region.width / spriteWidth;
+
     Sprite sprite = {
-        .spritesheet = LoadTexture(spritesheetPath),
-        .frames = (Rectangle*)malloc(spriteNumber * sizeof(Rectangle)),
+        .spritesheet = texture,
+        .region = region,
+        .spriteWidth = spriteWidth,
+        .spriteHeight = spriteHeight,
+        .columns = (col > 0) ? col : 1,
+        .spriteOffset = spriteOffset,
         .spriteNumber = spriteNumber
     };
 
-    //int lin = sprite.spritesheet.height / spriteHeight;
-    int col = sprite.spritesheet.width / spriteWidth;
-
-    int i = 0;
-    int j = 0;
-    // TODO: rework the "offset" thing because it only works for x-axis offset, and not a sprite offset per-se
-    for (int frameIndex = 0; frameIndex < spriteNumber; frameIndex++) {
-        sprite.frames[frameIndex].x = (spriteOffset + i) * spriteWidth;
-        sprite.frames[frameIndex].y = j * spriteHeight;
-        sprite.frames[frameIndex].width = spriteWidth;
-        sprite.frames[frameIndex].height = spriteHeight;
-
-        i++;
-        if (i >= col) {
-            i = 0;
-            j++;
-        }
-    }
-
     return sprite;
 }
 
-// @info Free allocated memory for the sprite frames and unload the spritesheet
+// @info Same as MakeSprite(), with an already loaded spritesheet (the sprite owns one reference of it)
+Sprite MakeSpriteFromTexture(Texture2D spritesheet, u16 spriteNumber, u8 spriteWidth, u8 spriteHeight, u8 spriteOffset)
+{
+    Rectangle region = {0, 0, spritesheet.width, spritesheet.height};
+    return MakeSpriteFromRegion(spritesheet, region, spriteNumber, spriteWidth, spriteHeight, spriteOffset);
+}
+
+// @info Release the spritesheet
 void FreeSprite(Sprite sprite)
 {
     #ifdef DEBUG
@@ -60,132 +178,1796 @@ void FreeSprite(Sprite sprite)
         printf("DEBUG: Destroying sprite -> ");
         NO_COLOR;
     #endif
-    free(sprite.frames);
-    UnloadTexture(sprite.spritesheet);
+    UnloadTextureCached(sprite.spritesheet);
 }
 
-void DrawSprite(Sprite sprite, u8 frameIndex, u8 scalingFactor, Vector2 position)
+void DrawSprite(Sprite sprite, u16 frameIndex, u8 scalingFactor, Vector2 position)
 {
+    Rectangle frame = GetSpriteFrame(&sprite, frameIndex);
+
     DrawTexturePro(
         sprite.spritesheet,         // Texture2D texture
-        sprite.frames[frameIndex],  // Rectangle source
+        frame,                      // Rectangle source
         (Rectangle) {               // Rectangle dest
             position.x,
             position.y,
-            sprite.frames[frameIndex].width * scalingFactor,
-            sprite.frames[frameIndex].height * scalingFactor,
+            frame.width * scalingFactor,
+            frame.height * scalingFactor,
         },
         (Vector2) {                 // Vector2 origin
-            (sprite.frames[frameIndex].width/2) * scalingFactor,    // centers the sprite on the x wanted
-            (sprite.frames[frameIndex].height/2) * scalingFactor    // centers the sprite on the y wanted
+            (frame.width/2) * scalingFactor,    // centers the sprite on the x wanted
+            (frame.height/2) * scalingFactor    // centers the sprite on the y wanted
         },
         0,                          // float rotation
         WHITE                       // Color tint
     );
 }
 
-// Maps -------------------------------------------------------
-void MakeMap(Map *map, const char *mapData)
+// Atlases ----------------------------------------------------
+// A spritesheet waiting to be packed by MakeAtlas()
+typedef struct {
+    Image image;
+    int index;                  // in the 'spritesheetPaths' given to MakeAtlas()
+} AtlasImage;
+
+static int CompareAtlasImages(const void *a, const void *b)
 {
-    char tilesetPath[64];      // path to the tileset spritesheet
+    return ((const AtlasImage *)b)->image.height - ((const AtlasImage *)a)->image.height;
+}
 
-    FILE *mapFile = fopen(mapData, "r");
-    if (mapFile == NULL) {
-        RED_PRINT;
-        TraceLog(LOG_ERROR, "could not open/find mapdata file (%s)", mapData);
-        NO_COLOR;
+/*  @info Packs several spritesheets into as few textures (pages) as possible, so sprites made
+ *        with MakeSpriteFromAtlas() share a texture and can be drawn in the same batch
+ *  @param spritesheetPaths - the relative paths to the spritesheet image files
+ *  @param spritesheetsNumber - how much spritesheets to pack
+ *  @param pageSize - the width/height of a page (px), a spritesheet bigger than that is left out
+ *  @return an empty atlas if the texture cache can't hold all the pages */
+Atlas MakeAtlas(const char **spritesheetPaths, u16 spritesheetsNumber, int pageSize)
+{
+    static int atlasCount = 0;  // makes the cache keys of the pages unique
+
+    Atlas atlas = {
+        .entries = (AtlasEntry *)calloc(spritesheetsNumber, sizeof(AtlasEntry)),
+        .pages = (Texture2D *)malloc(spritesheetsNumber * sizeof(Texture2D)),    // worst case: one page each
+    };
+
+    AtlasImage *images = (AtlasImage *)malloc(spritesheetsNumber * sizeof(AtlasImage));
+    for (int i = 0; i < spritesheetsNumber; i++) {
+        images[i].image = LoadImage(spritesheetPaths[i]);
+        images[i].index = i;
     }
+    // shelf packing: the tallest spritesheets first, left to right, then on a new shelf below
+    qsort(images, spritesheetsNumber, sizeof(AtlasImage), CompareAtlasImages);
 
-    // Read the first line for map properties
-    fscanf(mapFile, "%03hhu %03hhu %03hhu %03hhu %03hhu\n",
-        &map->width,
-        &map->height,
-        &map->tilesetSpritesNumber,
-        &map->tileSize,
-        &map->layersNumber
-    );
-    fscanf(mapFile, "%s\n", tilesetPath);
-
-    // Dynamic layers/tilesX/tilesY allocation and parsing
-    map->tiles = (u8 ***)malloc(map->layersNumber * sizeof(u8 **));
-    for (int i = 0; i < map->layersNumber; i++) {                    // layer
-        map->tiles[i] = (u8 **)malloc(map->height * sizeof(u8 *));
-        for (int j = 0; j < map->height; j++) {                      // x
-            map->tiles[i][j] = (u8 *)malloc(map->width * sizeof(u8));
-            for (int k = 0; k < map->width; k++) {                   // y
-                fscanf(mapFile, "%hhu", &map->tiles[i][j][k]);       // get the tile ID
+    Image page = {0};
+    int x = 0, y = 0, shelfHeight = 0;
+    bool failed = false;
+    for (int n = 0; n <= spritesheetsNumber; n++) {
+        Image image = (n < spritesheetsNumber) ? images[n].image : (Image) {0};
+        bool last = (n == spritesheetsNumber);
+
+        if (!last && ((image.data == NULL) || (image.width > pageSize) || (image.height > pageSize))) {
+            YELLOW_PRINT;
+            TraceLog(LOG_WARNING, "[%s] can't be packed in a %dx%dpx atlas page", spritesheetPaths[images[n].index], pageSize, pageSize);
+            NO_COLOR;
+            continue;
+        }
+        if (!last && (x + image.width > pageSize)) {     // next shelf
+            x = 0;
+            y += shelfHeight + ATLAS_PADDING;
+            shelfHeight = 0;
+        }
+        // the current page is full (or everything is packed): upload it, cut to the used height
+        if ((page.data != NULL) && (last || (y + image.height > pageSize))) {
+            ImageCrop(&page, (Rectangle) {0, 0, pageSize, y + shelfHeight});
+            char key[TEXTURE_PATH_LENGTH];
+            snprintf(key, sizeof(key), "atlas-%d#%d", atlasCount, atlas.pagesNumber);
+            Texture2D texture = LoadTextureFromImage(page);
+            UnloadImage(page);
+            page = (Image) {0};
+            // the sprites share the page through its cache references, it can't live outside of the cache
+            if (!CacheTexture(key, texture)) {
+                if (texture.id != 0) UnloadTexture(texture);
+                failed = true;
+                break;
             }
+            atlas.pages[atlas.pagesNumber++] = texture;
+            x = y = shelfHeight = 0;
+        }
+        if (last) break;
+
+        if (page.data == NULL) {
+            page = GenImageColor(pageSize, pageSize, BLANK);
         }
+        Rectangle rect = {x, y, image.width, image.height};
+        ImageDraw(&page, image, (Rectangle) {0, 0, image.width, image.height}, rect, WHITE);
+
+        AtlasEntry *entry = &atlas.entries[atlas.entriesNumber++];
+        strncpy(entry->path, spritesheetPaths[images[n].index], TEXTURE_PATH_LENGTH - 1);
+        entry->page = atlas.pagesNumber;
+        entry->rect = rect;
+
+        x += image.width + ATLAS_PADDING;
+        if (image.height > shelfHeight) shelfHeight = image.height;
     }
 
-    map->tileset = MakeSprite(
-                    tilesetPath,
-                    map->tilesetSpritesNumber,
-                    map->tileSize,
-                    map->tileSize,
-                    0
-                );
+    for (int i = 0; i < spritesheetsNumber; i++) {
+        UnloadImage(images[i].image);
+    }
+    free(images);
+    atlasCount++;
 
-    fclose(mapFile);
+    if (failed) {
+        RED_PRINT;
+        TraceLog(LOG_ERROR, "could not make the atlas, its sprites will use their own spritesheet");
+        NO_COLOR;
+        FreeAtlas(atlas);
+        return (Atlas) {0};
+    }
 
     #ifdef DEBUG
         YELLOW_PRINT;
-        TraceLog(LOG_DEBUG,"Making map @ [%s]", mapData);
-        TraceLog(LOG_DEBUG,"    Map width:\t%d", map->width);
-        TraceLog(LOG_DEBUG,"    Map height:\t%d", map->height);
-        TraceLog(LOG_DEBUG,"    Map tiles:\t%d", map->width * map->height);
-        TraceLog(LOG_DEBUG,"    Map layers:\t%d", map->layersNumber);
-        TraceLog(LOG_DEBUG,"    Tile size:\t%d*%dpx", map->tileSize, map->tileSize);
-        TraceLog(LOG_DEBUG,"    Map size:\t%dx%dpx", map->tileSize * map->width, map->tileSize * map->height);
-        MAG_PRINT;
-        #if SHOW_MAP
-            for (int i = 0; i < map->layersNumber; i++) {    // layer
-                printf("MAP: Layer[%d]\n", i);
-                for (int j = 0; j < map->height; j++) {      // x
-                    for (int k = 0; k < map->width; k++) {   // y
-                        printf("%3hhu ", map->tiles[i][j][k]);
-                    }
-                    printf("\n");
-                }
-            }
-        #endif
+        TraceLog(LOG_DEBUG, "Made atlas: %d spritesheet(s) in %d page(s)", atlas.entriesNumber, atlas.pagesNumber);
         NO_COLOR;
     #endif
 
-    return;
+    return atlas;
 }
 
-void DrawMapLayer(Map map, u8 layerIndex, u8 scalingFactor)
+/*  @info Same as MakeSprite(), but the frames point into the atlas page holding the spritesheet
+ *        (falls back to MakeSprite() if the spritesheet is not in the atlas) */
+Sprite MakeSpriteFromAtlas(Atlas atlas, const char *spritesheetPath, u16 spriteNumber, u8 spriteWidth, u8 spriteHeight, u8 spriteOffset)
 {
-    // If you get a segfault here, that means the 'map.dat' file is wrong
-    // eg. the width/height of the map is set to some numbers,but the
-    // actual data parsed (matrix) does not have that size.
+    for (int i = 0; i < atlas.entriesNumber; i++) {
+        if (strcmp(atlas.entries[i].path, spritesheetPath) == 0) {
+            return MakeSpriteFromRegion(
+                ReferenceCachedTexture(atlas.pages[atlas.entries[i].page]),
+                atlas.entries[i].rect,
+                spriteNumber,
+                spriteWidth,
+                spriteHeight,
+                spriteOffset
+            );
+        }
+    }
 
-    int F = map.tileSize * scalingFactor;
+    return MakeSprite(spritesheetPath, spriteNumber, spriteWidth, spriteHeight, spriteOffset);
+}
 
-    for (int i = 0; i < map.height; i++) {
-        for (int j = 0; j < map.width; j++) {
-            // printf("[%d][%d][%d]\n", layerIndex, i, j);
-            DrawSprite(
-                map.tileset,
-                map.tiles[layerIndex][i][j],
-                scalingFactor,
-                (Vector2) {
-                    j * F - map.tileSize,   // - map.tileSize recenter
-                    i * F - map.tileSize,
-            });
+// @info Releases the atlas pages, they stay loaded as long as a sprite made from them exists
+void FreeAtlas(Atlas atlas)
+{
+    for (int i = 0; i < atlas.pagesNumber; i++) {
+        UnloadTextureCached(atlas.pages[i]);
+    }
+    free(atlas.pages);
+    free(atlas.entries);
+}
+
+// Sprite batch -----------------------------------------------
+// A textured quad waiting for FlushSpriteBatch(), already in screen/world coordinates
+typedef struct {
+    unsigned int textureId;
+    u8 layer;
+    u32 order;                  // submission order, keeps the sort stable
+    float x0, y0, x1, y1;       // top-left and bottom-right corners
+    float u0, v0, u1, v1;       // texture coordinates of the corners
+} BatchQuad;
+
+static BatchQuad spriteBatch[SPRITE_BATCH_SIZE];
+static int spriteBatchCount = 0;
+static u32 spriteBatchOrder = 0;       // sprites submitted since the batch was last empty
+static bool spriteBatchSorted = true;
+static bool spriteBatchDropping = false;    // warned about the sprites dropped while the batch is full
+
+static int CompareBatchQuads(const void *a, const void *b)
+{
+    const BatchQuad *qa = (const BatchQuad *)a;
+    const BatchQuad *qb = (const BatchQuad *)b;
+
+    if (qa->layer != qb->layer) return (qa->layer < qb->layer) ? -1 : 1;
+    if (qa->textureId != qb->textureId) return (qa->textureId < qb->textureId) ? -1 : 1;
+    return (qa->order < qb->order) ? -1 : (qa->order > qb->order);
+}
+
+// @info Starts collecting sprites, nothing is drawn until FlushSpriteBatch()
+void BeginSpriteBatch(void)
+{
+    spriteBatchCount = 0;
+    spriteBatchOrder = 0;
+    spriteBatchSorted = true;
+    spriteBatchDropping = false;
+}
+
+/*  @info Same as DrawSprite(), but the sprite is queued and drawn by FlushSpriteBatch(),
+ *        grouped with the other sprites of the same layer and spritesheet, it is dropped when the batch
+ *        is full: flushing early would draw every layer before the map layers they go between
+ *  @param layer - sprites are drawn from the lowest layer to the highest */
+void SubmitSprite(Sprite sprite, u16 frameIndex, u8 scalingFactor, Vector2 position, u8 layer)
+{
+    if (spriteBatchCount == SPRITE_BATCH_SIZE) {
+        if (!spriteBatchDropping) {
+            YELLOW_PRINT;
+            TraceLog(LOG_WARNING, "sprite batch is full (%d), dropping sprites until it is flushed", SPRITE_BATCH_SIZE);
+            NO_COLOR;
+            spriteBatchDropping = true;
         }
+        return;
     }
+
+    Rectangle frame = GetSpriteFrame(&sprite, frameIndex);
+    float width = frame.width * scalingFactor;
+    float height = frame.height * scalingFactor;
+    // same centering as DrawSprite()
+    float x = position.x - (frame.width/2) * scalingFactor;
+    float y = position.y - (frame.height/2) * scalingFactor;
+
+    spriteBatch[spriteBatchCount] = (BatchQuad) {
+        .textureId = sprite.spritesheet.id,
+        .layer = layer,
+        .order = spriteBatchOrder++,
+        .x0 = x,
+        .y0 = y,
+        .x1 = x + width,
+        .y1 = y + height,
+        .u0 = frame.x / sprite.spritesheet.width,
+        .v0 = frame.y / sprite.spritesheet.height,
+        .u1 = (frame.x + frame.width) / sprite.spritesheet.width,
+        .v1 = (frame.y + frame.height) / sprite.spritesheet.height,
+    };
+    spriteBatchCount++;
+    spriteBatchSorted = false;
 }
 
-void FreeMap(Map map)
+/*  @info Draws the queued sprites of the layers up to 'lastLayer', with one draw per spritesheet and layer,
+ *        the other layers stay queued (so they can be drawn between map layers, see DrawMapLayers()) */
+void FlushSpriteBatchLayers(u8 lastLayer)
 {
-    FreeSprite(map.tileset);
-    for (int i = 0; i < map.layersNumber; i++) {
-        for (int j = 0; j < map.height; j++) {
-            free(map.tiles[i][j]);
+    if (!spriteBatchSorted) {
+        qsort(spriteBatch, spriteBatchCount, sizeof(BatchQuad), CompareBatchQuads);
+        spriteBatchSorted = true;
+    }
+
+    int i = 0;
+    while ((i < spriteBatchCount) && (spriteBatch[i].layer <= lastLayer)) {
+        unsigned int textureId = spriteBatch[i].textureId;
+        u8 layer = spriteBatch[i].layer;
+
+        rlSetTexture(textureId);
+        rlBegin(RL_QUADS);
+            rlColor4ub(255, 255, 255, 255);
+            rlNormal3f(0.0f, 0.0f, 1.0f);
+            for ( ; (i < spriteBatchCount) && (spriteBatch[i].textureId == textureId) && (spriteBatch[i].layer == layer); i++) {
+                const BatchQuad *quad = &spriteBatch[i];
+                // same vertex order as DrawTexturePro()
+                rlTexCoord2f(quad->u0, quad->v0);
+                rlVertex2f(quad->x0, quad->y0);
+                rlTexCoord2f(quad->u0, quad->v1);
+                rlVertex2f(quad->x0, quad->y1);
+                rlTexCoord2f(quad->u1, quad->v1);
+                rlVertex2f(quad->x1, quad->y1);
+                rlTexCoord2f(quad->u1, quad->v0);
+                rlVertex2f(quad->x1, quad->y0);
+            }
+        rlEnd();
+    }
+    rlSetTexture(0);
+
+    // the layers left are still sorted
+    memmove(spriteBatch, spriteBatch + i, (spriteBatchCount - i) * sizeof(BatchQuad));
+    spriteBatchCount -= i;
+    if (spriteBatchCount == 0) spriteBatchOrder = 0;    // nothing left to order against
+    if (i > 0) spriteBatchDropping = false;
+}
+
+// @info Draws all the queued sprites and empties the batch
+void FlushSpriteBatch(void)
+{
+    FlushSpriteBatchLayers(UINT8_MAX);
+}
+
+// Maps -------------------------------------------------------
+_Static_assert(sizeof(MapFileHeader) == 80, "MapFileHeader must match the binary map file layout");
+
+// Text map parser, keeps track of the line/column for the error messages
+typedef struct {
+    const char *fileName;
+    const unsigned char *data;
+    int size;
+    int pos;
+    int line;
+    int column;
+} MapParser;
+
+__attribute__((format(printf, 2, 3)))
+static void MapParserError(const MapParser *parser, const char *format, ...)
+{
+    char message[128];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    RED_PRINT;
+    TraceLog(LOG_ERROR, "%s:%d:%d: %s", parser->fileName, parser->line, parser->column, message);
+    NO_COLOR;
+}
+
+static bool IsMapBlank(unsigned char c)
+{
+    return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+}
+
+// @info Skips spaces/tabs, and newlines too if 'newlines' is true
+static void SkipMapBlanks(MapParser *parser, bool newlines)
+{
+    while ((parser->pos < parser->size) && IsMapBlank(parser->data[parser->pos])) {
+        if (parser->data[parser->pos] == '\n') {
+            if (!newlines) return;
+            parser->line++;
+            parser->column = 0;
+        }
+        parser->pos++;
+        parser->column++;
+    }
+}
+
+// @info Parses a decimal number in [0, max], that must be followed by a blank or the end of the file
+static bool ParseMapNumber(MapParser *parser, int max, const char *what, int *value)
+{
+    int start = parser->pos;
+    int number = 0;
+
+    while ((parser->pos < parser->size) && (parser->data[parser->pos] >= '0') && (parser->data[parser->pos] <= '9')) {
+        number = number * 10 + (parser->data[parser->pos] - '0');
+        if (number > max) {
+            MapParserError(parser, "%s must be <= %d", what, max);
+            return false;
+        }
+        parser->pos++;
+        parser->column++;
+    }
+
+    if ((parser->pos == start) ||
+        ((parser->pos < parser->size) && !IsMapBlank(parser->data[parser->pos]))) {
+        MapParserError(parser, "expected %s, got '%c'", what, (parser->pos < parser->size) ? parser->data[parser->pos] : ' ');
+        return false;
+    }
+
+    *value = number;
+    return true;
+}
+
+// @info Tile ID i of a buffer of 'tileBytes' bytes tile IDs (can be unaligned in an encoded file)
+static u16 ReadTileID(const u8 *tiles, u8 tileBytes, int i)
+{
+    if (tileBytes == 1) return tiles[i];
+    u16 tile;
+    memcpy(&tile, tiles + 2 * i, sizeof(tile));
+    return tile;
+}
+
+static void WriteTileID(u8 *tiles, u8 tileBytes, int i, u16 tile)
+{
+    if (tileBytes == 1) {
+        tiles[i] = tile;
+    } else {
+        memcpy(tiles + 2 * i, &tile, sizeof(tile));
+    }
+}
+
+// @info Parses a whole text map already loaded in memory (see assets/data/maps/help.dat)
+static bool ParseMapText(Map *map, MapParser *parser)
+{
+    // Header: width height tilesetSpritesNumber tileSize layersNumber, on the first line,
+    // the tile size can also be given as "tileWidth tileHeight" (6 fields)
+    int header[6];
+    int fields = 0;
+    SkipMapBlanks(parser, false);
+    while ((parser->pos < parser->size) && (parser->data[parser->pos] != '\n')) {
+        if (fields == 6) {
+            MapParserError(parser, "too much map properties, expected 5 or 6");
+            return false;
+        }
+        int max = (fields == 2) ? 65535 : 255;   // the tileset's number of sprites is the only 16-bit property
+        if (!ParseMapNumber(parser, max, "a map property", &header[fields++])) return false;
+        SkipMapBlanks(parser, false);
+    }
+    if (fields < 5) {
+        MapParserError(parser, "expected 5 or 6 map properties, got %d", fields);
+        return false;
+    }
+    if (fields == 6) {
+        if (header[3] != header[4]) {
+            MapParserError(parser, "tiles must be square, got %d*%dpx", header[3], header[4]);
+            return false;
+        }
+        header[4] = header[5];
+    }
+    for (int i = 0; i < 5; i++) {
+        if (header[i] == 0) {
+            MapParserError(parser, "map properties can't be 0");
+            return false;
+        }
+    }
+    map->width = header[0];
+    map->height = header[1];
+    map->tilesetSpritesNumber = header[2];
+    map->tileSize = header[3];
+    map->layersNumber = header[4];
+
+    // Tileset path, on the second line
+    SkipMapBlanks(parser, true);
+    int pathStart = parser->pos;
+    while ((parser->pos < parser->size) && !IsMapBlank(parser->data[parser->pos])) {
+        parser->pos++;
+        parser->column++;
+    }
+    int pathLength = parser->pos - pathStart;
+    if ((pathLength == 0) || (pathLength >= MAP_PATH_LENGTH)) {
+        MapParserError(parser, "expected a tileset path (1 to %d characters)", MAP_PATH_LENGTH - 1);
+        return false;
+    }
+    memcpy(map->tilesetPath, parser->data + pathStart, pathLength);
+    map->tilesetPath[pathLength] = '\0';
+
+    // Every layer in a single allocation, in the same order as the file,
+    // 16-bit tile IDs only if the tileset needs them, narrowed below if the map does not
+    // (the highest ID of each size is MAP_EMPTY_TILE, written '-' in the file)
+    map->tilesNumber = map->width * map->height;
+    int tilesNumber = map->layersNumber * map->tilesNumber;
+    map->tileBytes = (map->tilesetSpritesNumber > 255) ? 2 : 1;
+    map->tiles = (u8 *)malloc(tilesNumber * map->tileBytes);
+    int maxTile = 0;
+    for (int i = 0; i < tilesNumber; i++) {
+        SkipMapBlanks(parser, true);
+        if (parser->pos >= parser->size) {
+            MapParserError(parser, "expected %d tiles (%dx%d, %d layer(s)), got %d", tilesNumber, map->width, map->height, map->layersNumber, i);
+            return false;
         }
-        free(map.tiles[i]);
+        int tile;
+        if ((parser->data[parser->pos] == '-') &&
+            ((parser->pos + 1 == parser->size) || IsMapBlank(parser->data[parser->pos + 1]))) {
+            tile = MAP_EMPTY_TILE;
+            parser->pos++;
+            parser->column++;
+        } else {
+            if (!ParseMapNumber(parser, map->tilesetSpritesNumber - 1, "a tile ID", &tile)) return false;
+            if (tile > maxTile) maxTile = tile;
+        }
+        WriteTileID(map->tiles, map->tileBytes, i, tile);
+    }
+    if ((map->tileBytes == 2) && (maxTile < 255)) {
+        for (int i = 0; i < tilesNumber; i++) {     // in place, tile i is read before being overwritten (0xFFFF -> 0xFF)
+            map->tiles[i] = ((u16 *)map->tiles)[i];
+        }
+        map->tileBytes = 1;
+        map->tiles = (u8 *)realloc(map->tiles, tilesNumber);
+    }
+
+    SkipMapBlanks(parser, true);
+    if (parser->pos < parser->size) {
+        MapParserError(parser, "too much tiles, expected %d (%dx%d, %d layer(s))", tilesNumber, map->width, map->height, map->layersNumber);
+        return false;
+    }
+
+    return true;
+}
+
+// @info Loads and parses a text map file in a single pass
+static bool LoadMapText(Map *map, const char *mapData)
+{
+    int dataSize = 0;
+    unsigned char *data = LoadFileData(mapData, &dataSize);
+    if (data == NULL) {
+        RED_PRINT;
+        TraceLog(LOG_ERROR, "could not open/find mapdata file (%s)", mapData);
+        NO_COLOR;
+        return false;
+    }
+
+    MapParser parser = {
+        .fileName = mapData,
+        .data = data,
+        .size = dataSize,
+        .line = 1,
+        .column = 1,
+    };
+    bool parsed = ParseMapText(map, &parser);
+    UnloadFileData(data);
+
+    if (!parsed) {
+        free(map->tiles);
+        *map = (Map) {0};
+    }
+
+    return parsed;
+}
+
+// @info Bits per palette index of a MAP_LAYER_PALETTE layer, the smallest that fits
+static int GetMapPaletteBits(int paletteSize)
+{
+    int bits = 1;
+    while ((1 << bits) < paletteSize) bits++;
+    return bits;
+}
+
+// @info Run-length encodes tiles (see MAP_LAYER_RLE) into out (at least (tileBytes + 1) * tilesNumber bytes)
+static size_t EncodeMapRLE(const u8 *tiles, int tilesNumber, u8 tileBytes, u8 *out)
+{
+    size_t size = 0;
+    int i = 0;
+    while (i < tilesNumber) {
+        int run = 1;
+        while ((i + run < tilesNumber) && (run < 129) &&
+               (ReadTileID(tiles, tileBytes, i + run) == ReadTileID(tiles, tileBytes, i))) run++;
+        if (run >= 2) {
+            out[size++] = 126 + run;
+            memcpy(out + size, tiles + i * tileBytes, tileBytes);
+            size += tileBytes;
+            i += run;
+            continue;
+        }
+        // literals, until the next run of 2 or more
+        int literal = 1;
+        while ((i + literal < tilesNumber) && (literal < 128) &&
+               ((i + literal + 1 >= tilesNumber) ||
+                (ReadTileID(tiles, tileBytes, i + literal) != ReadTileID(tiles, tileBytes, i + literal + 1)))) literal++;
+        out[size++] = literal - 1;
+        memcpy(out + size, tiles + i * tileBytes, literal * tileBytes);
+        size += literal * tileBytes;
+        i += literal;
+    }
+
+    return size;
+}
+
+// @info Worst case size of a layer encoded by EncodeMapLayer()
+static size_t GetMapLayerEncodedMax(int tilesNumber, u8 tileBytes)
+{
+    return (size_t)(tileBytes + 1) * tilesNumber + 2 + 256 * tileBytes;
+}
+
+/*  @info Encodes a layer the smallest way (see MapLayerEncoding)
+ *  @param out - at least GetMapLayerEncodedMax() bytes
+ *  @return the size written in out, MapLayerEncoding byte included */
+static size_t EncodeMapLayer(const u8 *tiles, int tilesNumber, u8 tileBytes, u8 *out)
+{
+    size_t rawSize = (size_t)tilesNumber * tileBytes;
+    u8 *rle = (u8 *)malloc((tileBytes + 1) * tilesNumber);
+    size_t rleSize = EncodeMapRLE(tiles, tilesNumber, tileBytes, rle);
+
+    // the palette holds at most 256 tile IDs, out of the 256 or 65536 possible
+    int idsNumber = 1 << (8 * tileBytes);
+    int *paletteIndex = (int *)malloc(idsNumber * sizeof(int));
+    u16 palette[256];
+    int paletteSize = 0;
+    for (int t = 0; t < idsNumber; t++) paletteIndex[t] = -1;
+    for (int i = 0; (i < tilesNumber) && (paletteSize <= 256); i++) {
+        u16 tile = ReadTileID(tiles, tileBytes, i);
+        if (paletteIndex[tile] == -1) {
+            if (paletteSize < 256) palette[paletteSize] = tile;
+            paletteIndex[tile] = paletteSize++;
+        }
+    }
+    int bits = GetMapPaletteBits(paletteSize);
+    size_t packedSize = ((size_t)tilesNumber * bits + 7) / 8;
+    size_t paletteLayerSize = (paletteSize <= 256) ? 1 + paletteSize * tileBytes + packedSize : SIZE_MAX;
+
+    size_t size = 1;
+    if ((rleSize <= paletteLayerSize) && (rleSize < rawSize)) {
+        out[0] = MAP_LAYER_RLE;
+        memcpy(out + 1, rle, rleSize);
+        size += rleSize;
+    } else if (paletteLayerSize < rawSize) {
+        out[0] = MAP_LAYER_PALETTE;
+        out[size++] = (u8)paletteSize;  // 256 wraps to 0
+        for (int p = 0; p < paletteSize; p++) {
+            WriteTileID(out + size, tileBytes, p, palette[p]);
+        }
+        size += paletteSize * tileBytes;
+        // low bits first, an index can straddle two bytes
+        u32 acc = 0;
+        int accBits = 0;
+        for (int i = 0; i < tilesNumber; i++) {
+            acc |= (u32)paletteIndex[ReadTileID(tiles, tileBytes, i)] << accBits;
+            accBits += bits;
+            while (accBits >= 8) {
+                out[size++] = acc & 0xFF;
+                acc >>= 8;
+                accBits -= 8;
+            }
+        }
+        if (accBits > 0) out[size++] = acc & 0xFF;
+    } else {
+        out[0] = MAP_LAYER_RAW;
+        memcpy(out + 1, tiles, rawSize);
+        size += rawSize;
+    }
+
+    free(paletteIndex);
+    free(rle);
+    return size;
+}
+
+/*  @info Expands an encoded layer (see EncodeMapLayer()) into tiles
+ *  @param data - the layer, moved past it
+ *  @return false if the layer is corrupted */
+static bool DecodeMapLayer(const u8 **data, const u8 *end, u8 *tiles, int tilesNumber, u8 tileBytes)
+{
+    const u8 *in = *data;
+    if (in >= end) return false;
+    u8 encoding = *in++;
+
+    switch (encoding) {
+        case MAP_LAYER_RAW:
+            if (end - in < tilesNumber * tileBytes) return false;
+            memcpy(tiles, in, tilesNumber * tileBytes);
+            in += tilesNumber * tileBytes;
+            break;
+        case MAP_LAYER_RLE:
+            for (int i = 0; i < tilesNumber; ) {
+                if (in >= end) return false;
+                int control = *in++;
+                int count = (control < 128) ? control + 1 : control - 126;
+                if ((count > tilesNumber - i) || (end - in < ((control < 128) ? count : 1) * tileBytes)) return false;
+                if (control < 128) {
+                    memcpy(tiles + i * tileBytes, in, count * tileBytes);
+                    in += count * tileBytes;
+                } else if (tileBytes == 1) {
+                    memset(tiles + i, *in++, count);
+                } else {
+                    u16 tile = ReadTileID(in, tileBytes, 0);
+                    in += tileBytes;
+                    for (int k = 0; k < count; k++) WriteTileID(tiles, tileBytes, i + k, tile);
+                }
+                i += count;
+            }
+            break;
+        case MAP_LAYER_PALETTE: {
+            if (in >= end) return false;
+            int paletteSize = (*in == 0) ? 256 : *in;
+            in++;
+            int bits = GetMapPaletteBits(paletteSize);
+            const u8 *palette = in;
+            if ((size_t)(end - in) < (size_t)paletteSize * tileBytes + ((size_t)tilesNumber * bits + 7) / 8) return false;
+            in += paletteSize * tileBytes;
+            u32 acc = 0;
+            int accBits = 0;
+            for (int i = 0; i < tilesNumber; i++) {
+                while (accBits < bits) {
+                    acc |= (u32)*in++ << accBits;
+                    accBits += 8;
+                }
+                int index = acc & ((1 << bits) - 1);
+                acc >>= bits;
+                accBits -= bits;
+                if (index >= paletteSize) return false;
+                WriteTileID(tiles, tileBytes, i, ReadTileID(palette, tileBytes, index));
+            }
+            break;
+        }
+        default:
+            return false;
+    }
+
+    *data = in;
+    return true;
+}
+
+// @info Memory-maps a binary map file (see MapFileHeader), the tiles are used in place unless encoded
+static bool LoadMapBinary(Map *map, const char *mapData)
+{
+    int fd = open(mapData, O_RDONLY);
+    struct stat fileStat;
+    if ((fd < 0) || (fstat(fd, &fileStat) < 0)) {
+        RED_PRINT;
+        TraceLog(LOG_ERROR, "could not open/find mapdata file (%s)", mapData);
+        NO_COLOR;
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    // private writable mapping: SetMapTile() can edit the tiles without touching the file
+    void *fileData = MAP_FAILED;
+    if ((size_t)fileStat.st_size >= sizeof(MapFileHeader)) {
+        fileData = mmap(NULL, fileStat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (fileData == MAP_FAILED) {
+        RED_PRINT;
+        TraceLog(LOG_ERROR, "could not map binary mapdata file (%s)", mapData);
+        NO_COLOR;
+        return false;
+    }
+
+    const MapFileHeader *header = (const MapFileHeader *)fileData;
+    size_t tilesSize = header->layersNumber * header->width * header->height * header->tileBytes;
+    if ((header->version != MAP_FILE_VERSION) || (header->encoding > MAP_ENCODING_LAYERS) ||
+        ((header->tileBytes != 1) && (header->tileBytes != 2)) ||
+        ((header->encoding == MAP_ENCODING_RAW) && ((size_t)fileStat.st_size < sizeof(MapFileHeader) + tilesSize))) {
+        RED_PRINT;
+        TraceLog(LOG_ERROR, "unsupported or truncated binary mapdata file (%s)", mapData);
+        NO_COLOR;
+        munmap(fileData, fileStat.st_size);
+        return false;
+    }
+    // same as the text map properties, the tile IDs are checked by MakeMapAttributes()
+    if ((header->width == 0) || (header->height == 0) || (header->layersNumber == 0) ||
+        (header->tileSize == 0) || (header->tilesetSpritesNumber == 0)) {
+        RED_PRINT;
+        TraceLog(LOG_ERROR, "map properties can't be 0 (%s)", mapData);
+        NO_COLOR;
+        munmap(fileData, fileStat.st_size);
+        return false;
+    }
+
+    map->width = header->width;
+    map->height = header->height;
+    map->layersNumber = header->layersNumber;
+    map->tileSize = header->tileSize;
+    map->tilesetSpritesNumber = header->tilesetSpritesNumber;
+    map->tileBytes = header->tileBytes;
+    memcpy(map->tilesetPath, header->tilesetPath, MAP_PATH_LENGTH);
+    map->tilesetPath[MAP_PATH_LENGTH - 1] = '\0';
+
+    map->tilesNumber = map->width * map->height;
+
+    if (header->encoding == MAP_ENCODING_LAYERS) {
+        // decoded into its own buffer, the file is not needed anymore
+        const u8 *data = (const u8 *)fileData + sizeof(MapFileHeader);
+        const u8 *end = (const u8 *)fileData + fileStat.st_size;
+        map->tiles = (u8 *)malloc(tilesSize);
+        bool decoded = true;
+        for (int layer = 0; decoded && (layer < map->layersNumber); layer++) {
+            decoded = DecodeMapLayer(&data, end, map->tiles + layer * map->tilesNumber * map->tileBytes, map->tilesNumber, map->tileBytes);
+        }
+        munmap(fileData, fileStat.st_size);
+        if (!decoded) {
+            RED_PRINT;
+            TraceLog(LOG_ERROR, "corrupted binary mapdata file (%s)", mapData);
+            NO_COLOR;
+            free(map->tiles);
+            *map = (Map) {0};
+            return false;
+        }
+        return true;
+    }
+
+    map->tiles = (u8 *)fileData + sizeof(MapFileHeader);
+    map->fileData = fileData;
+    map->fileSize = fileStat.st_size;
+
+    return true;
+}
+
+// @info Attributes of the tile (x, y): the attributes of its tiles on every layer
+static u8 GetMapCellAttributes(const Map *map, u8 x, u8 y)
+{
+    u8 attributes = 0;
+    for (int layer = 0; layer < map->layersNumber; layer++) {
+        u16 tile = GetMapTile(map, layer, x, y);
+        if (!IsMapTileEmpty(tile)) attributes |= map->tilesetAttributes[tile];
+    }
+    return attributes;
+}
+
+/*  @info Builds the attribute layer from the attributes of the tileset (see tileAttributes),
+ *        every tile ID is checked against the tileset on the way (a binary map file is not parsed)
+ *  @return false if a tile is not in the tileset */
+static bool MakeMapAttributes(Map *map, const char *mapData)
+{
+    map->tilesetAttributes = (u8 *)calloc(map->tilesetSpritesNumber, sizeof(u8));
+    for (size_t i = 0; i < sizeof(tileAttributes) / sizeof(tileAttributes[0]); i++) {
+        if (strcmp(tileAttributes[i].tilesetPath, map->tilesetPath) != 0) continue;
+        for (int t = tileAttributes[i].firstTile; (t <= tileAttributes[i].lastTile) && (t < map->tilesetSpritesNumber); t++) {
+            map->tilesetAttributes[t] |= tileAttributes[i].attributes;
+        }
+    }
+
+    map->attributes = (u8 *)calloc(map->tilesNumber, sizeof(u8));
+    for (int layer = 0; layer < map->layersNumber; layer++) {
+        for (int y = 0; y < map->height; y++) {
+            for (int x = 0; x < map->width; x++) {
+                u16 tile = GetMapTile(map, layer, x, y);
+                if (IsMapTileEmpty(tile)) continue;
+                if (tile >= map->tilesetSpritesNumber) {
+                    RED_PRINT;
+                    TraceLog(LOG_ERROR, "%s: tile ID %d at (%d, %d) of layer %d must be <= %d", mapData, tile, x, y, layer, map->tilesetSpritesNumber - 1);
+                    NO_COLOR;
+                    return false;
+                }
+                map->attributes[y * map->width + x] |= map->tilesetAttributes[tile];
+            }
+        }
+    }
+
+    return true;
+}
+
+/*  @info Loads the map properties and tiles from a text (.dat) or binary (.map) map file,
+ *        without touching the GPU (the tileset is loaded by MakeMap())
+ *  @param map - the map to fill, zeroed first
+ *  @param mapData - the relative path to the map file
+ *  @return false if the map could not be loaded */
+bool LoadMapData(Map *map, const char *mapData)
+{
+    *map = (Map) {0};
+
+    char magic[sizeof(MAP_FILE_MAGIC) - 1] = {0};
+    FILE *mapFile = fopen(mapData, "rb");
+    if (mapFile == NULL) {
+        RED_PRINT;
+        TraceLog(LOG_ERROR, "could not open/find mapdata file (%s)", mapData);
+        NO_COLOR;
+        return false;
+    }
+    fread(magic, 1, sizeof(magic), mapFile);
+    fclose(mapFile);
+
+    bool loaded = (memcmp(magic, MAP_FILE_MAGIC, sizeof(magic)) == 0) ? LoadMapBinary(map, mapData) : LoadMapText(map, mapData);
+    if (loaded && !MakeMapAttributes(map, mapData)) {
+        FreeMapData(map);
+        *map = (Map) {0};
+        loaded = false;
+    }
+    return loaded;
+}
+
+/*  @info Writes the map properties and tiles in the binary map format (see MapFileHeader)
+ *  @param compress - encode each layer the smallest way (see MapLayerEncoding), the tiles are kept
+ *                    raw (used in place at load time) unless that saves a quarter of their size
+ *  @return false if the file could not be written */
+bool SaveMapBinary(const Map *map, const char *fileName, bool compress)
+{
+    MapFileHeader header = {
+        .version = MAP_FILE_VERSION,
+        .width = map->width,
+        .height = map->height,
+        .layersNumber = map->layersNumber,
+        .tileSize = map->tileSize,
+        .tilesetSpritesNumber = map->tilesetSpritesNumber,
+        .tileBytes = map->tileBytes,
+    };
+    memcpy(header.magic, MAP_FILE_MAGIC, sizeof(header.magic));
+    memcpy(header.tilesetPath, map->tilesetPath, strnlen(map->tilesetPath, MAP_PATH_LENGTH - 1));  // zero-initialised, stays terminated
+
+    FILE *output = fopen(fileName, "wb");
+    if (output == NULL) {
+        RED_PRINT;
+        TraceLog(LOG_ERROR, "could not open file (%s)", fileName);
+        NO_COLOR;
+        return false;
+    }
+
+    size_t layerSize = map->tilesNumber * map->tileBytes;
+    size_t tilesSize = map->layersNumber * layerSize;
+    const u8 *tiles = map->tiles;
+    u8 *encoded = NULL;
+    if (compress) {
+        encoded = (u8 *)malloc(map->layersNumber * GetMapLayerEncodedMax(map->tilesNumber, map->tileBytes));
+        size_t encodedSize = 0;
+        for (int layer = 0; layer < map->layersNumber; layer++) {
+            encodedSize += EncodeMapLayer(map->tiles + layer * layerSize, map->tilesNumber, map->tileBytes, encoded + encodedSize);
+        }
+        // decoding costs a copy of the tiles at load time, a few bytes saved are not worth losing the mmap
+        if (encodedSize * 4 <= tilesSize * 3) {
+            header.encoding = MAP_ENCODING_LAYERS;
+            tiles = encoded;
+            tilesSize = encodedSize;
+        }
+    }
+
+    bool written = (fwrite(&header, sizeof(header), 1, output) == 1) &&
+                   (fwrite(tiles, 1, tilesSize, output) == tilesSize);
+    fclose(output);
+    free(encoded);
+
+    return written;
+}
+
+// @info Frees what LoadMapData() allocated (or maps)
+void FreeMapData(Map *map)
+{
+    if (map->fileData != NULL) {
+        munmap(map->fileData, map->fileSize);
+    } else {
+        free(map->tiles);
+    }
+    free(map->attributes);
+    free(map->tilesetAttributes);
+    map->tiles = NULL;
+    map->fileData = NULL;
+    map->attributes = NULL;
+    map->tilesetAttributes = NULL;
+}
+
+// @info Finds the animated tiles of the map's tileset (see tileAnimations), every tile starts on its first frame
+static void MakeMapAnimations(Map *map)
+{
+    int animationsNumber = sizeof(tileAnimations) / sizeof(tileAnimations[0]);
+    map->animations = (u8 *)malloc(animationsNumber);
+    map->animationsNumber = 0;
+    for (int a = 0; a < animationsNumber; a++) {
+        const TileAnimation *animation = &tileAnimations[a];
+        if (strcmp(animation->tilesetPath, map->tilesetPath) != 0) continue;
+
+        bool valid = (animation->tile < map->tilesetSpritesNumber) && (animation->frameDuration > 0) &&
+                     (animation->framesNumber > 0) && (animation->framesNumber <= TILE_ANIMATION_MAX_FRAMES);
+        for (int f = 0; valid && (f < animation->framesNumber); f++) {
+            valid = (animation->frames[f] < map->tilesetSpritesNumber);
+        }
+        if (!valid) {
+            YELLOW_PRINT;
+            TraceLog(LOG_WARNING, "tile animation %d does not fit the tileset (%s), ignored", a, map->tilesetPath);
+            NO_COLOR;
+            continue;
+        }
+        map->animations[map->animationsNumber++] = a;
+    }
+    if (map->animationsNumber == 0) {
+        free(map->animations);
+        map->animations = NULL;
+        return;
+    }
+
+    map->tileFrames = (u16 *)malloc(map->tilesetSpritesNumber * sizeof(u16));
+    for (int t = 0; t < map->tilesetSpritesNumber; t++) map->tileFrames[t] = t;
+    for (int a = 0; a < map->animationsNumber; a++) {
+        const TileAnimation *animation = &tileAnimations[map->animations[a]];
+        map->tileFrames[animation->tile] = animation->frames[0];
+    }
+}
+
+static bool IsMapTileAnimated(const Map *map, u16 tile)
+{
+    for (int a = 0; a < map->animationsNumber; a++) {
+        if (tileAnimations[map->animations[a]].tile == tile) return true;
+    }
+    return false;
+}
+
+// @info Tile drawn for a map tile on this frame (see UpdateMapAnimations())
+static u16 GetMapTileFrame(const Map *map, u16 tile)
+{
+    return (map->tileFrames != NULL) ? map->tileFrames[tile] : tile;
+}
+
+// @info GPU side of MakeMap(): builds the tileset sprite and pre-renders the chunks
+static void MakeMapTileset(Map *map, Texture2D tileset)
+{
+    map->tileset = MakeSpriteFromTexture(
+                    tileset,
+                    map->tilesetSpritesNumber,
+                    map->tileSize,
+                    map->tileSize,
+                    0
+                );
+
+    MakeMapAnimations(map);
+    BakeMapChunks(map);
+}
+
+void MakeMap(Map *map, const char *mapData)
+{
+    if (!LoadMapData(map, mapData)) {
+        return;
+    }
+
+    MakeMapTileset(map, LoadTextureCached(map->tilesetPath));
+
+    #ifdef DEBUG
+        YELLOW_PRINT;
+        TraceLog(LOG_DEBUG,"Making map @ [%s]", mapData);
+        TraceLog(LOG_DEBUG,"    Map width:\t%d", map->width);
+        TraceLog(LOG_DEBUG,"    Map height:\t%d", map->height);
+        TraceLog(LOG_DEBUG,"    Map tiles:\t%d", map->width * map->height);
+        TraceLog(LOG_DEBUG,"    Map layers:\t%d", map->layersNumber);
+        TraceLog(LOG_DEBUG,"    Tile size:\t%d*%dpx", map->tileSize, map->tileSize);
+        TraceLog(LOG_DEBUG,"    Map size:\t%dx%dpx", map->tileSize * map->width, map->tileSize * map->height);
+        TraceLog(LOG_DEBUG,"    Memory-mapped:\t%s", (map->fileData != NULL) ? "yes" : "no");
+        MAG_PRINT;
+        #if SHOW_MAP
+            for (int i = 0; i < map->layersNumber; i++) {    // layer
+                printf("MAP: Layer[%d]\n", i);
+                for (int j = 0; j < map->height; j++) {      // x
+                    for (int k = 0; k < map->width; k++) {   // y
+                        printf("%3hu ", GetMapTile(map, i, k, j));
+                    }
+                    printf("\n");
+                }
+            }
+        #endif
+        NO_COLOR;
+    #endif
+
+    return;
+}
+
+// @info Worker thread of LoadMapAsync(): everything that does not need the GPU
+static void *MapLoadWorker(void *data)
+{
+    MapLoad *load = (MapLoad *)data;
+
+    if (LoadMapData(&load->map, load->path)) {
+        load->tilesetImage = LoadImage(load->map.tilesetPath);
+        load->succeeded = (load->tilesetImage.data != NULL);
+        if (!load->succeeded) FreeMapData(&load->map);
+    }
+
+    atomic_store(&load->done, true);
+    return NULL;
+}
+
+/*  @info Starts loading a map in the background: file reading, parsing and tileset decoding
+ *        are done by a worker thread, FinishMapLoad() does the GPU upload
+ *  @param mapData - the relative path to the map file
+ *  @return the job, to give to FinishMapLoad() or CancelMapLoad() (NULL if the path is too long
+ *          or the thread could not start) */
+MapLoad *LoadMapAsync(const char *mapData)
+{
+    if (strlen(mapData) >= TEXTURE_PATH_LENGTH) {
+        RED_PRINT;
+        TraceLog(LOG_ERROR, "map path is too long (%d characters max): %s", TEXTURE_PATH_LENGTH - 1, mapData);
+        NO_COLOR;
+        return NULL;
+    }
+
+    MapLoad *load = (MapLoad *)calloc(1, sizeof(MapLoad));
+    strcpy(load->path, mapData);
+    atomic_init(&load->done, false);
+
+    if (pthread_create(&load->thread, NULL, MapLoadWorker, load) != 0) {
+        RED_PRINT;
+        TraceLog(LOG_ERROR, "could not start loading map (%s)", mapData);
+        NO_COLOR;
+        free(load);
+        return NULL;
+    }
+
+    return load;
+}
+
+// @info Returns true once FinishMapLoad() can be called without blocking
+bool IsMapLoadDone(const MapLoad *load)
+{
+    return atomic_load(&load->done);
+}
+
+/*  @info Waits for the worker if it is not done yet, then uploads the tileset and
+ *        pre-renders the map chunks (main thread only), the job is freed
+ *  @param map - the map to fill, zeroed if the load failed
+ *  @return false if the map could not be loaded */
+bool FinishMapLoad(MapLoad *load, Map *map)
+{
+    pthread_join(load->thread, NULL);
+    bool succeeded = load->succeeded;
+
+    *map = load->map;
+    if (succeeded) {
+        MakeMapTileset(map, LoadTextureFromImageCached(map->tilesetPath, load->tilesetImage));
+        UnloadImage(load->tilesetImage);
+    } else {
+        *map = (Map) {0};
+    }
+
+    free(load);
+    return succeeded;
+}
+
+// @info Waits for the worker and throws away what it loaded, the job is freed
+void CancelMapLoad(MapLoad *load)
+{
+    pthread_join(load->thread, NULL);
+
+    if (load->succeeded) {
+        FreeMapData(&load->map);
+        UnloadImage(load->tilesetImage);
+    }
+
+    free(load);
+}
+
+void DrawMapLayer(Map map, u8 layerIndex, u8 scalingFactor)
+{
+    int F = map.tileSize * scalingFactor;
+
+    for (int i = 0; i < map.height; i++) {
+        for (int j = 0; j < map.width; j++) {
+            // printf("[%d][%d][%d]\n", layerIndex, i, j);
+            u16 tile = GetMapTile(&map, layerIndex, j, i);
+            if (IsMapTileEmpty(tile)) continue;
+            DrawSprite(
+                map.tileset,
+                GetMapTileFrame(&map, tile),
+                scalingFactor,
+                (Vector2) {
+                    j * F - map.tileSize,   // - map.tileSize recenter
+                    i * F - map.tileSize,
+            });
+        }
+    }
+}
+
+/*  @info Returns the world-space rectangle seen through a 2D camera
+ *  @param camera - the camera used in BeginMode2D()
+ *  @param width - the width of the render target the camera draws into (px)
+ *  @param height - the height of the render target the camera draws into (px) */
+Rectangle GetCameraViewRec(Camera2D camera, int width, int height)
+{
+    Vector2 corners[4] = {
+        GetScreenToWorld2D((Vector2) {0, 0}, camera),
+        GetScreenToWorld2D((Vector2) {width, 0}, camera),
+        GetScreenToWorld2D((Vector2) {0, height}, camera),
+        GetScreenToWorld2D((Vector2) {width, height}, camera),
+    };
+
+    // bounding box of the 4 corners, so a rotated camera still gets everything it sees
+    Vector2 min = corners[0];
+    Vector2 max = corners[0];
+    for (int i = 1; i < 4; i++) {
+        if (corners[i].x < min.x) min.x = corners[i].x;
+        if (corners[i].y < min.y) min.y = corners[i].y;
+        if (corners[i].x > max.x) max.x = corners[i].x;
+        if (corners[i].y > max.y) max.y = corners[i].y;
+    }
+
+    return (Rectangle) {min.x, min.y, max.x - min.x, max.y - min.y};
+}
+
+/*  @info Draws a render texture on the whole window, scaled up by the biggest integer factor that fits
+ *        and centered (letterbox), so the pixels stay square, call it between BeginDrawing()/EndDrawing()
+ *  @return where it was drawn on the window */
+Rectangle DrawRenderTarget(RenderTexture2D target, int screenWidth, int screenHeight)
+{
+    int width = target.texture.width;
+    int height = target.texture.height;
+
+    float scale = (screenWidth / width < screenHeight / height) ? screenWidth / width : screenHeight / height;
+    if (scale < 1) {    // window smaller than the target, it is shrunk to fit
+        scale = fminf((float)screenWidth / width, (float)screenHeight / height);
+    }
+
+    Rectangle destination = {
+        floorf((screenWidth - width * scale) / 2),
+        floorf((screenHeight - height * scale) / 2),
+        width * scale,
+        height * scale,
+    };
+    DrawTexturePro(
+        target.texture,
+        (Rectangle) {0, 0, width, -height},    // render textures are y-flipped
+        destination,
+        (Vector2) {0, 0},
+        0,
+        WHITE
+    );
+
+    return destination;
+}
+
+/*  @info Same as DrawMapLayer(), but only draws the tiles intersecting 'view',
+ *        so the cost depends on the screen size instead of the map size
+ *  @param view - the visible world rectangle, see GetCameraViewRec() */
+void DrawMapLayerView(Map map, u8 layerIndex, u8 scalingFactor, Rectangle view)
+{
+    int F = map.tileSize * scalingFactor;
+    Vector2 first = GetWorldMapTile(&map, (Vector2) {view.x, view.y}, scalingFactor);
+    Vector2 last = GetWorldMapTile(&map, (Vector2) {view.x + view.width, view.y + view.height}, scalingFactor);
+
+    int firstCol = first.x - 1;     // one tile of margin
+    int lastCol = last.x + 1;
+    int firstRow = first.y - 1;
+    int lastRow = last.y + 1;
+
+    if (firstCol < 0) firstCol = 0;
+    if (firstRow < 0) firstRow = 0;
+    if (lastCol > map.width) lastCol = map.width;
+    if (lastRow > map.height) lastRow = map.height;
+
+    for (int i = firstRow; i < lastRow; i++) {
+        for (int j = firstCol; j < lastCol; j++) {
+            u16 tile = GetMapTile(&map, layerIndex, j, i);
+            if (IsMapTileEmpty(tile)) continue;
+            DrawSprite(
+                map.tileset,
+                GetMapTileFrame(&map, tile),
+                scalingFactor,
+                (Vector2) {
+                    j * F - map.tileSize,
+                    i * F - map.tileSize,
+            });
+        }
+    }
+}
+
+/*  @info Lists the cells showing an animated tile, grouped by chunk, so only the ones of the visible chunks
+ *        are drawn (see DrawMapLayerChunks()), rebuilt when SetMapTile() adds or removes one */
+static void MakeMapAnimatedCells(Map *map)
+{
+    int chunksNumber = map->layersNumber * map->chunksX * map->chunksY;
+    u32 *first = map->chunkAnimatedCells;
+
+    free(map->animatedCells);
+    map->animatedCells = NULL;
+    map->animatedCellsDirty = false;
+    memset(first, 0, (chunksNumber + 1) * sizeof(u32));
+    if (map->animationsNumber == 0) return;
+
+    // counted per chunk, then each chunk gets its range
+    for (int layer = 0; layer < map->layersNumber; layer++) {
+        for (int y = 0; y < map->height; y++) {
+            for (int x = 0; x < map->width; x++) {
+                u16 tile = GetMapTile(map, layer, x, y);
+                if (IsMapTileEmpty(tile) || !IsMapTileAnimated(map, tile)) continue;
+                first[(layer * map->chunksY + y / MAP_CHUNK_SIZE) * map->chunksX + x / MAP_CHUNK_SIZE + 1]++;
+            }
+        }
+    }
+    for (int c = 0; c < chunksNumber; c++) first[c + 1] += first[c];
+    if (first[chunksNumber] == 0) return;
+
+    map->animatedCells = (u16 *)malloc(first[chunksNumber] * sizeof(u16));
+    u32 *next = (u32 *)malloc(chunksNumber * sizeof(u32));
+    memcpy(next, first, chunksNumber * sizeof(u32));
+    for (int layer = 0; layer < map->layersNumber; layer++) {
+        for (int y = 0; y < map->height; y++) {
+            for (int x = 0; x < map->width; x++) {
+                u16 tile = GetMapTile(map, layer, x, y);
+                if (IsMapTileEmpty(tile) || !IsMapTileAnimated(map, tile)) continue;
+                map->animatedCells[next[(layer * map->chunksY + y / MAP_CHUNK_SIZE) * map->chunksX + x / MAP_CHUNK_SIZE]++] = y * map->width + x;
+            }
+        }
+    }
+    free(next);
+}
+
+// @info Tiles of a chunk (the last chunks of a row/column are cut to the map size)
+static void GetMapChunkRec(const Map *map, int chunkIndex, int *layer, int *firstCol, int *firstRow, int *cols, int *rows)
+{
+    int chunksPerLayer = map->chunksX * map->chunksY;
+    *layer = chunkIndex / chunksPerLayer;
+    *firstCol = (chunkIndex % map->chunksX) * MAP_CHUNK_SIZE;
+    *firstRow = ((chunkIndex % chunksPerLayer) / map->chunksX) * MAP_CHUNK_SIZE;
+    *cols = (map->width - *firstCol < MAP_CHUNK_SIZE) ? map->width - *firstCol : MAP_CHUNK_SIZE;
+    *rows = (map->height - *firstRow < MAP_CHUNK_SIZE) ? map->height - *firstRow : MAP_CHUNK_SIZE;
+}
+
+/*  @info Renders the static tiles of one chunk into its render texture, a chunk without any
+ *        (see IsMapTileEmpty()) has no texture at all, the animated tiles are left out (see MakeMapAnimatedCells()) */
+static void BakeMapChunk(Map *map, int chunkIndex)
+{
+    int layer, firstCol, firstRow, cols, rows;
+    GetMapChunkRec(map, chunkIndex, &layer, &firstCol, &firstRow, &cols, &rows);
+    map->dirtyChunks[chunkIndex] = false;
+
+    if (map->chunkTiles[chunkIndex] == 0) {
+        if (map->chunks[chunkIndex].id != 0) UnloadRenderTexture(map->chunks[chunkIndex]);
+        map->chunks[chunkIndex] = (RenderTexture2D) {0};
+        return;
+    }
+    if (map->chunks[chunkIndex].id == 0) {
+        map->chunks[chunkIndex] = LoadRenderTexture(cols * map->tileSize, rows * map->tileSize);
+    }
+
+    BeginTextureMode(map->chunks[chunkIndex]);
+        ClearBackground(BLANK);
+        for (int i = 0; i < rows; i++) {
+            for (int j = 0; j < cols; j++) {
+                u16 tile = GetMapTile(map, layer, firstCol + j, firstRow + i);
+                if (IsMapTileEmpty(tile) || IsMapTileAnimated(map, tile)) continue;
+                DrawTextureRec(
+                    map->tileset.spritesheet,
+                    GetSpriteFrame(&map->tileset, tile),
+                    (Vector2) {j * map->tileSize, i * map->tileSize},
+                    WHITE
+                );
+            }
+        }
+    EndTextureMode();
+}
+
+/*  @info Pre-renders every layer of the map into MAP_CHUNK_SIZE*MAP_CHUNK_SIZE tiles chunks,
+ *        must be called outside of BeginMode2D() (MakeMap() already does it) */
+void BakeMapChunks(Map *map)
+{
+    map->chunksX = (map->width + MAP_CHUNK_SIZE - 1) / MAP_CHUNK_SIZE;
+    map->chunksY = (map->height + MAP_CHUNK_SIZE - 1) / MAP_CHUNK_SIZE;
+    int chunksNumber = map->layersNumber * map->chunksX * map->chunksY;
+
+    map->chunks = (RenderTexture2D *)calloc(chunksNumber, sizeof(RenderTexture2D));
+    map->dirtyChunks = (bool *)malloc(chunksNumber * sizeof(bool));
+    map->chunkTiles = (u16 *)calloc(chunksNumber, sizeof(u16));
+    map->chunkAnimatedCells = (u32 *)calloc(chunksNumber + 1, sizeof(u32));
+
+    // overlay layers are mostly empty, only their occupied chunks get a texture
+    for (int layer = 0; layer < map->layersNumber; layer++) {
+        for (int y = 0; y < map->height; y++) {
+            for (int x = 0; x < map->width; x++) {
+                u16 tile = GetMapTile(map, layer, x, y);
+                if (IsMapTileEmpty(tile) || IsMapTileAnimated(map, tile)) continue;
+                map->chunkTiles[(layer * map->chunksY + y / MAP_CHUNK_SIZE) * map->chunksX + x / MAP_CHUNK_SIZE]++;
+            }
+        }
+    }
+    MakeMapAnimatedCells(map);
+
+    for (int c = 0; c < chunksNumber; c++) {
+        BakeMapChunk(map, c);
+    }
+}
+
+// @info Re-renders the chunks whose tiles changed, must be called outside of BeginMode2D()
+void UpdateMapChunks(Map *map)
+{
+    int chunksNumber = map->layersNumber * map->chunksX * map->chunksY;
+
+    if (map->animatedCellsDirty) MakeMapAnimatedCells(map);
+
+    for (int c = 0; c < chunksNumber; c++) {
+        if (map->dirtyChunks[c]) BakeMapChunk(map, c);
+    }
+}
+
+/*  @info Changes a tile of the map (MAP_EMPTY_TILE clears it) and invalidates the chunk it belongs to
+ *        (a map stored with 8-bit tile IDs can't take a tile past the 255th), a cell outside of the map is refused */
+void SetMapTile(Map *map, u8 layerIndex, u8 x, u8 y, u16 tile)
+{
+    if ((layerIndex >= map->layersNumber) || (x >= map->width) || (y >= map->height)) {
+        RED_PRINT;
+        TraceLog(LOG_ERROR, "cell (%d, %d) of layer %d is outside of the map (%dx%d, %d layer(s))", x, y, layerIndex, map->width, map->height, map->layersNumber);
+        NO_COLOR;
+        return;
+    }
+    if ((map->tileBytes == 1) && (tile >= 255) && !IsMapTileEmpty(tile)) {
+        RED_PRINT;
+        TraceLog(LOG_ERROR, "tile %d does not fit in the 8-bit tile IDs of the map (0-254)", tile);
+        NO_COLOR;
+        return;
+    }
+    if (!IsMapTileEmpty(tile) && (tile >= map->tilesetSpritesNumber)) {
+        RED_PRINT;
+        TraceLog(LOG_ERROR, "tile %d is not in the tileset (%d tiles)", tile, map->tilesetSpritesNumber);
+        NO_COLOR;
+        return;
+    }
+    int chunkIndex = (layerIndex * map->chunksY + y / MAP_CHUNK_SIZE) * map->chunksX + x / MAP_CHUNK_SIZE;
+    u16 previous = GetMapTile(map, layerIndex, x, y);
+    bool wasAnimated = !IsMapTileEmpty(previous) && IsMapTileAnimated(map, previous);
+    bool animated = !IsMapTileEmpty(tile) && IsMapTileAnimated(map, tile);
+    map->chunkTiles[chunkIndex] += (!IsMapTileEmpty(tile) && !animated) - (!IsMapTileEmpty(previous) && !wasAnimated);
+    WriteTileID(map->tiles, map->tileBytes, GetMapTileIndex(map, layerIndex, x, y), tile);
+    map->dirtyChunks[chunkIndex] = true;
+    if (animated || wasAnimated) map->animatedCellsDirty = true;
+    map->attributes[y * map->width + x] = GetMapCellAttributes(map, x, y);
+}
+
+/*  @info Once per tick: moves the animated tiles to their frame of 'tick' by updating the tile remap
+ *        table, O(animations of the tileset): neither the map data nor the chunks are touched, the
+ *        animated cells are drawn over the chunks by DrawMapLayerChunks() */
+void UpdateMapAnimations(Map *map, u32 tick)
+{
+    for (int a = 0; a < map->animationsNumber; a++) {
+        const TileAnimation *animation = &tileAnimations[map->animations[a]];
+        map->tileFrames[animation->tile] = animation->frames[(tick / animation->frameDuration) % animation->framesNumber];
+    }
+}
+
+/*  @info Same as DrawMapLayerView(), but draws the pre-rendered chunks (one quad per
+ *        visible chunk instead of one per visible tile, plus one per animated tile), see BakeMapChunks() */
+void DrawMapLayerChunks(Map map, u8 layerIndex, u8 scalingFactor, Rectangle view)
+{
+    int F = map.tileSize * scalingFactor;
+    // the chunk [cy][cx] starts at its first tile, (cx * MAP_CHUNK_SIZE, cy * MAP_CHUNK_SIZE)
+    Vector2 first = GetWorldMapTile(&map, (Vector2) {view.x, view.y}, scalingFactor);
+    Vector2 last = GetWorldMapTile(&map, (Vector2) {view.x + view.width, view.y + view.height}, scalingFactor);
+
+    int firstCol = floorf(first.x / MAP_CHUNK_SIZE);
+    int lastCol = floorf(last.x / MAP_CHUNK_SIZE) + 1;
+    int firstRow = floorf(first.y / MAP_CHUNK_SIZE);
+    int lastRow = floorf(last.y / MAP_CHUNK_SIZE) + 1;
+
+    if (firstCol < 0) firstCol = 0;
+    if (firstRow < 0) firstRow = 0;
+    if (lastCol > map.chunksX) lastCol = map.chunksX;
+    if (lastRow > map.chunksY) lastRow = map.chunksY;
+
+    for (int cy = firstRow; cy < lastRow; cy++) {
+        for (int cx = firstCol; cx < lastCol; cx++) {
+            Texture2D chunk = map.chunks[(layerIndex * map.chunksY + cy) * map.chunksX + cx].texture;
+            if (chunk.id == 0) continue;    // empty
+            Vector2 position = GetMapTileWorldPosition(&map, cx * MAP_CHUNK_SIZE, cy * MAP_CHUNK_SIZE, scalingFactor);
+            DrawTexturePro(
+                chunk,
+                (Rectangle) {0, 0, chunk.width, -chunk.height},    // render textures are y-flipped
+                (Rectangle) {
+                    position.x,
+                    position.y,
+                    chunk.width * scalingFactor,
+                    chunk.height * scalingFactor,
+                },
+                (Vector2) {0, 0},
+                0,
+                WHITE
+            );
+        }
+    }
+
+    // the animated tiles are not in the chunks, they are drawn over them with their frame of this tick
+    if (map.animatedCells == NULL) return;
+    for (int cy = firstRow; cy < lastRow; cy++) {
+        for (int cx = firstCol; cx < lastCol; cx++) {
+            int c = (layerIndex * map.chunksY + cy) * map.chunksX + cx;
+            for (u32 a = map.chunkAnimatedCells[c]; a < map.chunkAnimatedCells[c + 1]; a++) {
+                int x = map.animatedCells[a] % map.width;
+                int y = map.animatedCells[a] / map.width;
+                u16 tile = GetMapTile(&map, layerIndex, x, y);
+                if (IsMapTileEmpty(tile)) continue;     // cleared since, until UpdateMapChunks()
+                Vector2 position = GetMapTileWorldPosition(&map, x, y, scalingFactor);
+                DrawTexturePro(
+                    map.tileset.spritesheet,
+                    GetSpriteFrame(&map.tileset, GetMapTileFrame(&map, tile)),
+                    (Rectangle) {position.x, position.y, F, F},
+                    (Vector2) {0, 0},
+                    0,
+                    WHITE
+                );
+            }
+        }
+    }
+}
+
+/*  @info Draws every layer of the map with the queued sprites in between (see SubmitSprite()): the sprites
+ *        of layer N are drawn over the map layer N and under the next ones, the batch is empty afterwards */
+void DrawMapLayers(Map map, u8 scalingFactor, Rectangle view)
+{
+    for (int layer = 0; layer < map.layersNumber; layer++) {
+        DrawMapLayerChunks(map, layer, scalingFactor, view);
+        FlushSpriteBatchLayers(layer);
+    }
+    FlushSpriteBatch();
+}
+
+void FreeMap(Map map)
+{
+    int chunksNumber = map.layersNumber * map.chunksX * map.chunksY;
+    for (int c = 0; c < chunksNumber; c++) {
+        if (map.chunks[c].id != 0) UnloadRenderTexture(map.chunks[c]);
+    }
+    free(map.chunks);
+    free(map.dirtyChunks);
+    free(map.chunkTiles);
+    free(map.animatedCells);
+    free(map.chunkAnimatedCells);
+    free(map.tileFrames);
+    free(map.animations);
+
+    FreeSprite(map.tileset);
+    FreeMapData(&map);
+}
+
+// World ------------------------------------------------------
+/*  @info Lists the maps connected to a map, both ways (see mapConnections)
+ *  @param neighbours - room for 'capacity' MapIDs
+ *  @param types - the connection of each neighbour as seen from 'mapID' (can be NULL, else 'capacity' of them)
+ *  @return the number of neighbours written, the ones past 'capacity' are left out */
+u8 GetMapNeighbours(MapID mapID, MapID *neighbours, ConnectionType *types, u8 capacity)
+{
+    // the same seam seen from the other map
+    static const ConnectionType opposite[] = {
+        [CONNECTION_NORTH] = CONNECTION_SOUTH,
+        [CONNECTION_SOUTH] = CONNECTION_NORTH,
+        [CONNECTION_WEST] = CONNECTION_EAST,
+        [CONNECTION_EAST] = CONNECTION_WEST,
+        [CONNECTION_WARP] = CONNECTION_WARP,
+    };
+    u8 neighboursNumber = 0;
+
+    for (size_t i = 0; (i < sizeof(mapConnections) / sizeof(mapConnections[0])) && (neighboursNumber < capacity); i++) {
+        const MapConnection *connection = &mapConnections[i];
+        if (connection->from == mapID) {
+            if (types != NULL) types[neighboursNumber] = connection->type;
+            neighbours[neighboursNumber++] = connection->to;
+        } else if (connection->to == mapID) {
+            if (types != NULL) types[neighboursNumber] = opposite[connection->type];
+            neighbours[neighboursNumber++] = connection->from;
+        }
+    }
+
+    return neighboursNumber;
+}
+
+// @info Finds the seam between two maps, both ways (the offset is negated when seen from 'to')
+static const MapConnection *FindMapSeam(MapID from, MapID to, bool *reversed)
+{
+    for (size_t i = 0; i < sizeof(mapConnections) / sizeof(mapConnections[0]); i++) {
+        const MapConnection *connection = &mapConnections[i];
+        if (connection->type == CONNECTION_WARP) continue;
+        if ((connection->from == from) && (connection->to == to)) {
+            *reversed = false;
+            return connection;
+        }
+        if ((connection->from == to) && (connection->to == from)) {
+            *reversed = true;
+            return connection;
+        }
+    }
+
+    return NULL;
+}
+
+// @info Memory a resident map takes: its tiles and its chunk textures (RGBA, the empty chunks have none)
+static size_t GetMapMemory(const Map *map)
+{
+    size_t memory = map->layersNumber * map->tilesNumber * map->tileBytes + map->tilesNumber;
+    int chunksNumber = map->layersNumber * map->chunksX * map->chunksY;
+    for (int c = 0; c < chunksNumber; c++) {
+        memory += (size_t)map->chunks[c].texture.width * map->chunks[c].texture.height * 4;
+    }
+    return memory;
+}
+
+// @info Places the resident maps sharing a border with the current map around it (in its tiles)
+static void UpdateWorldSeams(World *world)
+{
+    MapID neighbours[MAP_COUNT];
+    ConnectionType types[MAP_COUNT];
+    u8 neighboursNumber = GetMapNeighbours(world->current, neighbours, types, MAP_COUNT);
+    Map *current = GetWorldMap(world);
+
+    for (int id = 0; id < MAP_COUNT; id++) {
+        world->maps[id].seam = false;
+    }
+    if (!world->maps[world->current].resident) return;
+
+    for (int n = 0; n < neighboursNumber; n++) {
+        WorldMap *neighbour = &world->maps[neighbours[n]];
+        if (!neighbour->resident || (types[n] == CONNECTION_WARP)) continue;
+
+        bool reversed;
+        int offset = FindMapSeam(world->current, neighbours[n], &reversed)->offset;
+        if (reversed) offset = -offset;
+        switch (types[n]) {
+            case CONNECTION_NORTH: neighbour->origin = (Vector2) {offset, -neighbour->map.height}; break;
+            case CONNECTION_SOUTH: neighbour->origin = (Vector2) {offset, current->height}; break;
+            case CONNECTION_WEST: neighbour->origin = (Vector2) {-neighbour->map.width, offset}; break;
+            case CONNECTION_EAST: neighbour->origin = (Vector2) {current->width, offset}; break;
+            default: break;
+        }
+        neighbour->seam = true;
+    }
+}
+
+/*  @info Loads the first map of the world (blocking), its neighbours are loaded in the background
+ *        by UpdateWorld()
+ *  @param memoryBudget - bytes of map tiles and chunk textures kept loaded, see WORLD_MEMORY_BUDGET
+ *  @return false if the first map could not be loaded, the world can only be given to FreeWorld() then */
+bool MakeWorld(World *world, MapID start, size_t memoryBudget)
+{
+    *world = (World) {
+        .current = start,
+        .memoryBudget = memoryBudget,
+    };
+
+    WorldMap *worldMap = &world->maps[start];
+    MakeMap(&worldMap->map, mapTable[start]);
+    worldMap->resident = (worldMap->map.tiles != NULL);
+    worldMap->failed = !worldMap->resident;
+
+    return worldMap->resident;
+}
+
+/*  @info Once per frame, outside of BeginMode2D(): finishes the background loads, starts loading
+ *        the neighbours of the current map, changes the current map when 'focus' walks across
+ *        a seam, and frees the maps out of the memory budget
+ *  @param focus - position followed in the current map (eg. the player), in px
+ *  @return what to add to the positions in the current map if it changed (px), {0, 0} otherwise */
+Vector2 UpdateWorld(World *world, Vector2 focus, u8 scalingFactor)
+{
+    world->tick++;
+
+    for (int id = 0; id < MAP_COUNT; id++) {
+        WorldMap *worldMap = &world->maps[id];
+        if ((worldMap->load != NULL) && IsMapLoadDone(worldMap->load)) {
+            worldMap->resident = FinishMapLoad(worldMap->load, &worldMap->map);
+            worldMap->failed = !worldMap->resident;
+            worldMap->load = NULL;
+        }
+    }
+
+    // walking into a neighbour through a seam makes it the current map
+    Vector2 shift = {0, 0};
+    Map *current = GetWorldMap(world);
+    UpdateWorldSeams(world);
+    if (world->maps[world->current].resident) {
+        int F = current->tileSize * scalingFactor;
+        Vector2 focusTile = GetWorldMapTile(current, focus, scalingFactor);
+        int focusX = focusTile.x;
+        int focusY = focusTile.y;
+
+        for (int id = 0; id < MAP_COUNT; id++) {
+            WorldMap *neighbour = &world->maps[id];
+            if (!neighbour->seam) continue;
+
+            int x = focusX - neighbour->origin.x;
+            int y = focusY - neighbour->origin.y;
+            if ((x >= 0) && (y >= 0) && (x < neighbour->map.width) && (y < neighbour->map.height)) {
+                shift = (Vector2) {-neighbour->origin.x * F, -neighbour->origin.y * F};
+                WarpWorld(world, id);
+                break;
+            }
+        }
+    }
+
+    // the current map and its neighbours are kept, and loaded if they are not
+    MapID neighbours[MAP_COUNT];
+    u8 neighboursNumber = GetMapNeighbours(world->current, neighbours, NULL, MAP_COUNT);
+    world->maps[world->current].lastUsed = world->tick;
+    for (int n = 0; n < neighboursNumber; n++) {
+        WorldMap *neighbour = &world->maps[neighbours[n]];
+        neighbour->lastUsed = world->tick;
+        if (!neighbour->resident && !neighbour->failed && (neighbour->load == NULL)) {
+            neighbour->load = LoadMapAsync(mapTable[neighbours[n]]);
+            neighbour->failed = (neighbour->load == NULL);
+        }
+    }
+
+    // the other maps are freed from the least recently used, until the budget is met
+    size_t memory = 0;
+    for (int id = 0; id < MAP_COUNT; id++) {
+        if (world->maps[id].resident) memory += GetMapMemory(&world->maps[id].map);
+    }
+    while (memory > world->memoryBudget) {
+        WorldMap *oldest = NULL;
+        for (int id = 0; id < MAP_COUNT; id++) {
+            WorldMap *worldMap = &world->maps[id];
+            if (worldMap->resident && (worldMap->lastUsed != world->tick) &&
+                ((oldest == NULL) || (worldMap->lastUsed < oldest->lastUsed))) {
+                oldest = worldMap;
+            }
+        }
+        if (oldest == NULL) break;  // only the current map and its neighbours left
+
+        memory -= GetMapMemory(&oldest->map);
+        FreeMap(oldest->map);
+        oldest->map = (Map) {0};
+        oldest->resident = false;
+        oldest->seam = false;
+    }
+
+    for (int id = 0; id < MAP_COUNT; id++) {
+        WorldMap *worldMap = &world->maps[id];
+        if (!worldMap->resident) continue;
+        // only the maps on screen are animated
+        if ((id == (int)world->current) || worldMap->seam) UpdateMapAnimations(&worldMap->map, world->tick);
+        UpdateMapChunks(&worldMap->map);
+    }
+
+    return shift;
+}
+
+/*  @info Makes a map the current one (eg. through a door), positions are not changed
+ *  @return false if the map is not loaded yet, try again on a next frame */
+bool WarpWorld(World *world, MapID mapID)
+{
+    if (!world->maps[mapID].resident) return false;
+
+    world->current = mapID;
+    UpdateWorldSeams(world);
+
+    return true;
+}
+
+/*  @info What the tile (x, y) is (TileAttribute bits), in the current map tiles: the maps sharing
+ *        a border with it are looked up past its edges, where there is no map it is solid */
+u8 GetWorldTileAttributes(World *world, int x, int y)
+{
+    Map *current = GetWorldMap(world);
+    if ((x >= 0) && (y >= 0) && (x < current->width) && (y < current->height)) {
+        return GetMapTileAttributes(current, x, y);
+    }
+
+    for (int id = 0; id < MAP_COUNT; id++) {
+        WorldMap *neighbour = &world->maps[id];
+        if (!neighbour->seam) continue;
+        int localX = x - neighbour->origin.x;
+        int localY = y - neighbour->origin.y;
+        if ((localX >= 0) && (localY >= 0) && (localX < neighbour->map.width) && (localY < neighbour->map.height)) {
+            return GetMapTileAttributes(&neighbour->map, localX, localY);
+        }
+    }
+
+    return TILE_SOLID;
+}
+
+/*  @info Movement check in O(1), for the player and the NPCs: how far a step of 'stepSize' px from
+ *        'position' (world px, as drawn with 'scalingFactor') towards 'direction' can go,
+ *        only the tile under the destination is read (one tile of each 2x2 block with 16 px steps
+ *        on 8 px tiles, see tileAttributes in maps.h)
+ *  @return 0 if blocked, 1, or 2 when jumping over a ledge */
+u8 GetWorldStep(World *world, Vector2 position, Direction direction, int stepSize, u8 scalingFactor)
+{
+    static const u8 ledges[] = {
+        [DIRECTION_DOWN]  = TILE_LEDGE_DOWN,
+        [DIRECTION_UP]    = 0,
+        [DIRECTION_LEFT]  = TILE_LEDGE_LEFT,
+        [DIRECTION_RIGHT] = TILE_LEDGE_RIGHT,
+    };
+    const u8 blocking = TILE_SOLID | TILE_WATER | TILE_COUNTER | TILE_LEDGE_DOWN | TILE_LEDGE_LEFT | TILE_LEDGE_RIGHT;
+
+    if (!world->maps[world->current].resident) return 0;   // no map to walk on
+
+    Map *current = GetWorldMap(world);
+    Vector2 step = GetDirectionVector(direction);
+
+    for (u8 steps = 1; steps <= 2; steps++) {
+        Vector2 destination = {position.x + step.x * stepSize * steps, position.y + step.y * stepSize * steps};
+        Vector2 tile = GetWorldMapTile(current, destination, scalingFactor);
+        u8 attributes = GetWorldTileAttributes(world, tile.x, tile.y);
+        if ((steps == 1) && (attributes & ledges[direction])) continue;    // jumps over it
+        return (attributes & blocking) ? 0 : steps;
+    }
+
+    return 0;
+}
+
+// @info Returns the current map of the world
+Map *GetWorldMap(World *world)
+{
+    return &world->maps[world->current].map;
+}
+
+/*  @info Draws a layer of the current map and of the maps it shares a border with,
+ *        like DrawMapLayerChunks() does for one map */
+void DrawWorldLayer(World *world, u8 layerIndex, u8 scalingFactor, Rectangle view)
+{
+    Map *current = GetWorldMap(world);
+    if (layerIndex < current->layersNumber) {
+        DrawMapLayerChunks(*current, layerIndex, scalingFactor, view);
+    }
+
+    int F = current->tileSize * scalingFactor;
+    for (int id = 0; id < MAP_COUNT; id++) {
+        WorldMap *neighbour = &world->maps[id];
+        if (!neighbour->seam || (layerIndex >= neighbour->map.layersNumber)) continue;
+
+        // the neighbour is drawn as if it was at (0, 0), moved to its origin
+        Vector2 origin = {neighbour->origin.x * F, neighbour->origin.y * F};
+        rlPushMatrix();
+        rlTranslatef(origin.x, origin.y, 0);
+        DrawMapLayerChunks(
+            neighbour->map,
+            layerIndex,
+            scalingFactor,
+            (Rectangle) {view.x - origin.x, view.y - origin.y, view.width, view.height}
+        );
+        rlPopMatrix();
+    }
+}
+
+// @info Same as DrawMapLayers(), for the current map and the maps it shares a border with
+void DrawWorld(World *world, u8 scalingFactor, Rectangle view)
+{
+    int layersNumber = GetWorldMap(world)->layersNumber;
+    for (int id = 0; id < MAP_COUNT; id++) {
+        if (world->maps[id].seam && (world->maps[id].map.layersNumber > layersNumber)) {
+            layersNumber = world->maps[id].map.layersNumber;
+        }
+    }
+
+    for (int layer = 0; layer < layersNumber; layer++) {
+        DrawWorldLayer(world, layer, scalingFactor, view);
+        FlushSpriteBatchLayers(layer);
+    }
+    FlushSpriteBatch();
+}
+
+// @info Frees every loaded map and waits for the ones still loading
+void FreeWorld(World *world)
+{
+    for (int id = 0; id < MAP_COUNT; id++) {
+        WorldMap *worldMap = &world->maps[id];
+        if (worldMap->load != NULL) CancelMapLoad(worldMap->load);
+        if (worldMap->resident) FreeMap(worldMap->map);
+        *worldMap = (WorldMap) {0};
     }
-    free(map.tiles);
 }
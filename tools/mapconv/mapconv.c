@@ -0,0 +1,33 @@
+#include <stdio.h>
+#include <string.h>
+#include <raylib.h>
+#include "pokaylib.h"
+
+// Converts a text map (.dat) into a binary map (.map) that MakeMap() memory-maps
+int main(int argc, char *argv[])
+{
+    bool compress = (argc == 4) && (strcmp(argv[1], "-c") == 0);
+    if (argc != 3 + compress) {
+        printf("Usage: %s [-c] <map>.dat <map>.map\n", argv[0]);
+        printf(" -c  encode the layers (run-length or palette) when it saves a quarter of the tiles\n");
+        return 1;
+    }
+    const char *input = argv[1 + compress];
+    const char *output = argv[2 + compress];
+
+    SetTraceLogLevel(LOG_WARNING);
+
+    Map map;
+    if (!LoadMapData(&map, input)) {
+        return 1;
+    }
+
+    bool saved = SaveMapBinary(&map, output, compress);
+    if (saved) {
+        printf("[%s] -> [%s] (%dx%d tiles, %d layer(s), %ld bytes)\n", input, output, map.width, map.height, map.layersNumber, (long)GetFileLength(output));
+    }
+
+    FreeMapData(&map);
+
+    return saved ? 0 : 1;
+}
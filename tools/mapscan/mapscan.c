@@ -3,268 +3,885 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <raylib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define MAPSCAN_X86
+#endif
+
+// A tile is a view into the pixels of its image, nothing is copied
+typedef struct {
+    const Color *PXS;   // top-left pixel of the tile
+    int stride;         // pixels from one row of the tile to the next (the image width)
+} Tile;
+
+typedef struct {
+    Color *PXS;         // RGBA pixels, row by row: PXS[y * width + x]
+    int width;
+    int height;
+    int tilesNumber;    // whole tiles only, sheets can have tens of thousands of them
+} MapImage;
 
+// Open addressing hash table of the tileset tiles, indexed by their pixels hash
 typedef struct {
-    uint8_t R;
-    uint8_t G;
-    uint8_t B;
-} Pixel;
+    uint64_t hash;
+    int tile;       // tileset index, -1 if the slot is empty
+} TileSlot;
 
 typedef struct {
-    Pixel **PXS;
-    uint16_t width;
-    uint16_t height;
-    uint16_t tilesNumber;
-} Image;
-
-void getDimensions(const char *filename, Image *img);
-void parsePixels(const char *filename, Image *img);
-void slicingTiles(Image *img, Pixel ****tiles);
-void freeImg(Image *img);
-void freeTiles(int width, int height, Pixel ***tiles);
-bool compareTile(Pixel **mapPX, Pixel **tilePX);
-void compareMap(Pixel ***map, Pixel ***tiles, int Nmap, int Ntiles, Image img, const char *outputfile);
-void writePNG(Image mapImg, Image tilesetImg, const char *tilesetfile, const char *outputfile);
+    TileSlot *slots;
+    uint32_t mask;  // slots number - 1 (power of 2)
+} TileTable;
+
+// A tileset loaded once by the batch mode, for every map that uses it
+typedef struct {
+    char path[256];
+    uint16_t tileSize;
+    MapImage img;
+    Tile *tiles;
+    TileTable table;
+} Tileset;
+
+// A worker of compareMap() matches the map tile rows [firstRow, lastRow)
+typedef struct {
+    pthread_t thread;
+    Tile *map;
+    Tile *tiles;
+    TileTable *table;
+    int *indices;       // shared by all the workers, one per map tile
+    int W;              // map width in tiles
+    int firstRow, lastRow;
+    bool started;       // runs on its own thread
+    int H;              // map height in tiles
+    atomic_int *rowsDone;   // shared, for the progress
+    atomic_int *percent;    // shared, last progress printed
+} MatchJob;
+
+bool loadImage(const char *filename, MapImage *img);
+bool checkMapSize(const char *mapfile, MapImage mapImg);
+Tile *slicingTiles(MapImage *img);
+void freeImg(MapImage *img);
+void freeTiles(Tile *tiles);
+bool compareTileScalar(Tile mapTile, Tile tile);
+#ifdef MAPSCAN_X86
+bool compareTileSSE2(Tile mapTile, Tile tile);
+bool compareTileAVX2(Tile mapTile, Tile tile);
+#endif
+void selectCompareTile(void);
+void benchCompareTile(Tile *tiles, int Ntiles);
+int *compareMap(Tile *map, Tile *tiles, TileTable *table, int Nmap, MapImage img, int jobs);
+void *matchRows(void *arg);
+bool extractTileset(Tile *map, int Nmap, MapImage mapImg, const char *tilesetfile, const char *outputfile, bool flips);
+void flipTile(Tile tile, Color *PXS, bool horizontal, bool vertical);
+uint64_t hashTile(Tile tile);
+void makeTileTable(int Ntiles, TileTable *table);
+void insertTile(TileTable *table, Tile *tiles, int t);
+void buildTileTable(Tile *tiles, int Ntiles, TileTable *table);
+int findTile(TileTable *table, Tile *tiles, Tile mapTile);
+void freeTileTable(TileTable *table);
+bool writeMap(MapImage mapImg, MapImage tilesetImg, const char *tilesetfile, int *indices, const char *outputfile);
+int batchConvert(const char *mapsdir, const char *tilesetsdir, const char *outputdir, int jobs);
+bool isUpToDate(const char *outputfile, const char *mapfile, const char *tilesetfile);
+bool isNewer(struct timespec a, struct timespec b);
+Tileset *loadTileset(Tileset **tilesets, int *Ntilesets, const char *path);
+bool convertMap(const char *mapfile, Tileset *tileset, const char *tilesetname, const char *outputfile, int jobs);
+
+#define TILESET_COLUMNS 16   // width in tiles of the tilesets made by -x
+#define TILESET_MAX_TILES 65535 // tileset sprites number of the map format (16-bit)
+#define MAP_MAX_SIZE 255        // map width/height (tiles) and tile size (px) of the map format (8-bit)
 
 uint16_t tileSize; // Global
+bool verbose = false; // Global, print every map tile lookup
+bool (*compareTile)(Tile mapTile, Tile tile) = compareTileScalar; // Global, see selectCompareTile()
+const char *compareTileName = "scalar";
 
-// in Aseprite, export in CSS and rename to .dat, delete the first lines of information and the ; } at the end
 int main(int argc, char *argv[])
 {
-    if (argc != 4) {
-        printf("Usage: %s <map>.dat <tileset>.dat <tile size>\n", argv[0]);
+    bool bench = false;
+    bool extract = false;
+    bool flips = false;
+    bool batch = false;
+    int jobs = 1;
+    int arg = 1;
+    for ( ; (arg < argc) && (argv[arg][0] == '-'); arg++) {
+        if ((strcmp(argv[arg], "-b") == 0) || (strcmp(argv[arg], "--bench") == 0)) {
+            bench = true;
+        } else if ((strcmp(argv[arg], "-x") == 0) || (strcmp(argv[arg], "--extract") == 0)) {
+            extract = true;
+        } else if ((strcmp(argv[arg], "-v") == 0) || (strcmp(argv[arg], "--verbose") == 0)) {
+            verbose = true;
+        } else if ((strcmp(argv[arg], "-B") == 0) || (strcmp(argv[arg], "--batch") == 0)) {
+            batch = true;
+        } else if ((strcmp(argv[arg], "-f") == 0) || (strcmp(argv[arg], "--flips") == 0)) {
+            flips = true;
+        } else if ((strncmp(argv[arg], "-j", 2) == 0) && (argv[arg][2] != '\0')) {
+            jobs = atoi(argv[arg] + 2);     // -jN
+        } else if ((strcmp(argv[arg], "-j") == 0) && (arg + 1 < argc)) {
+            jobs = atoi(argv[++arg]);       // -j N
+        } else {
+            break;
+        }
+    }
+    if ((argc - arg != 3) || (jobs < 1)) {
+        printf("Usage: %s [-v] [-b] [-j N] [-x [-f]] <map>.png <tileset>.png <tile size>\n", argv[0]);
+        printf("       %s [-v] [-j N] -B <maps dir> <tilesets dir> <output dir>\n", argv[0]);
+        printf(" -v, --verbose  print the lookup of every map tile\n");
+        printf(" -b, --bench    time the tile comparison kernels on the map tiles, no output\n");
+        printf(" -j N           match the map tiles on N threads (default 1)\n");
+        printf(" -x, --extract  make <tileset>.png from the unique tiles of the map instead of reading it\n");
+        printf(" -f, --flips    with -x, also count the tiles that are a mirror of another one\n");
+        printf(" -B, --batch    convert every map listed in <maps dir>/maps.txt (\"<map>.png <tileset>.png <tile size>\" per line)\n");
+        printf("                into <output dir>/<map>.dat, skipping the maps already up to date\n");
         return 1; // Return error if tile size is not provided
     }
 
-    tileSize = atoi(argv[3]);
+    if (batch) {
+        selectCompareTile();
+        SetTraceLogLevel(LOG_WARNING);
+        return (batchConvert(argv[arg], argv[arg + 1], argv[arg + 2], jobs) == 0) ? 0 : 1;
+    }
+
+    int size = atoi(argv[arg + 2]);
+    if ((size <= 0) || (size > MAP_MAX_SIZE)) {
+        printf("Error: the tile size must be 1-%d px, got [%s]\n", MAP_MAX_SIZE, argv[arg + 2]);
+        return 1;
+    }
+    tileSize = size;
     printf("Tile size: %d*%d px\n", tileSize, tileSize);
 
-    const char *mapfile = argv[1];
-    const char *tilesetfile = argv[2];
+    const char *mapfile = argv[arg];
+    const char *tilesetfile = argv[arg + 1];
 
-    Image tilesetImg;
-    Image mapImg;
-    Pixel ***tilesetTiles;
-    Pixel ***mapTiles;
+    selectCompareTile();
 
-    // rename the output from <map>.css to <map>.dat
+    MapImage tilesetImg;
+    MapImage mapImg;
+
+    // rename the output from <map>.png to <map>.dat
     size_t mapfile_length = strlen(mapfile);
     char *outputfile = (char *)malloc(mapfile_length + 1); // +1 for null terminator
 
-    // Copy the map filename and replace .css with .dat
+    // Copy the map filename and replace .png with .dat
     strcpy(outputfile, mapfile);
     char *map_extension = strrchr(outputfile, '.');
     if (map_extension) {
         strcpy(map_extension, ".dat");
     }
 
-    getDimensions(tilesetfile, &tilesetImg);
-    getDimensions(mapfile, &mapImg);
+    SetTraceLogLevel(LOG_WARNING);
+    if (extract) {
+        if (!loadImage(mapfile, &mapImg)) {
+            free(outputfile);
+            return 1;
+        }
+        if (!checkMapSize(mapfile, mapImg)) {
+            freeImg(&mapImg);
+            free(outputfile);
+            return 1;
+        }
 
-    parsePixels(tilesetfile, &tilesetImg);
-    parsePixels(mapfile, &mapImg);
+        Tile *mapTiles = slicingTiles(&mapImg);
+        bool extracted = extractTileset(mapTiles, mapImg.tilesNumber, mapImg, tilesetfile, outputfile, flips);
 
-    writePNG(mapImg, tilesetImg, tilesetfile, outputfile);
+        freeTiles(mapTiles);
+        freeImg(&mapImg);
+        free(outputfile);
+        return extracted ? 0 : 1;
+    }
+    if (!loadImage(tilesetfile, &tilesetImg)) {
+        free(outputfile);
+        return 1;
+    }
+    if (!loadImage(mapfile, &mapImg)) {
+        freeImg(&tilesetImg);
+        free(outputfile);
+        return 1;
+    }
+    if (!bench && !checkMapSize(mapfile, mapImg)) {
+        freeImg(&tilesetImg);
+        freeImg(&mapImg);
+        free(outputfile);
+        return 1;
+    }
 
-    slicingTiles(&tilesetImg, &tilesetTiles);
-    slicingTiles(&mapImg, &mapTiles);
-    compareMap(mapTiles, tilesetTiles, mapImg.tilesNumber, tilesetImg.tilesNumber, mapImg, outputfile);
+    Tile *tilesetTiles = slicingTiles(&tilesetImg);
+    Tile *mapTiles = slicingTiles(&mapImg);
+    bool written = true;
+    if (bench) {
+        benchCompareTile(mapTiles, mapImg.tilesNumber);
+    } else {
+        TileTable table;
+        buildTileTable(tilesetTiles, tilesetImg.tilesNumber, &table);
+        int *indices = compareMap(mapTiles, tilesetTiles, &table, mapImg.tilesNumber, mapImg, jobs);
+        written = writeMap(mapImg, tilesetImg, tilesetfile, indices, outputfile);
+        free(indices);
+        freeTileTable(&table);
+    }
     //compareTile(mapTiles[1], tilesetTiles[0]);
 
+    freeTiles(mapTiles);
+    freeTiles(tilesetTiles);
     freeImg(&tilesetImg);
     freeImg(&mapImg);
-    freeTiles(mapImg.width, mapImg.height, mapTiles);
-    freeTiles(tilesetImg.width, tilesetImg.height, tilesetTiles);
+    free(outputfile);
 
-    return 0;
+    return written ? 0 : 1;
 }
 
-void getDimensions(const char *filename, Image *img)
+// Decodes the whole image at once into contiguous RGBA pixels
+bool loadImage(const char *filename, MapImage *img)
 {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
+    Image image = LoadImage(filename);
+    if (image.data == NULL) {
         printf("Error: Could not open file [%s]\n", filename);
-        return;
+        return false;
     }
-
-    int maxX = 0, maxY = 0;
-    char line[50];
-    while (fgets(line, sizeof(line), file)) {
-        int x, y;
-        sscanf(line, "%dpx %dpx", &x, &y);
-        if (x > maxX) maxX = x;
-        if (y > maxY) maxY = y;
+    if ((image.width < tileSize) || (image.height < tileSize)) {
+        printf("Error: [%s] is %d*%d px, smaller than a %d*%d px tile\n", filename, image.width, image.height, tileSize, tileSize);
+        UnloadImage(image);
+        return false;
     }
+    ImageFormat(&image, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
 
-    img->width = maxX + 1;
-    img->height = maxY + 1;
-    img->tilesNumber = img->width/tileSize * img->height/tileSize;
+    img->PXS = (Color *)image.data;
+    img->width = image.width;
+    img->height = image.height;
+    img->tilesNumber = (img->width/tileSize) * (img->height/tileSize);
+
+    // the color of a transparent pixel means nothing, so they all look the same
+    for (int i = 0; i < img->width * img->height; i++) {
+        if (img->PXS[i].a == 0) img->PXS[i] = (Color) {0, 0, 0, 0};
+    }
 
     printf("[%s] is %d*%d px -> %d tiles\n", filename, img->width, img->height, img->tilesNumber);
 
-    img->PXS = (Pixel **)malloc(img->width * sizeof(Pixel *));
-    for (int i = 0; i < img->width; i++) {
-        img->PXS[i] = (Pixel *)malloc(img->height * sizeof(Pixel));
-        for (int j = 0; j < img->height; j++) {
-            img->PXS[i][j].R = 0;
-            img->PXS[i][j].G = 0;
-            img->PXS[i][j].B = 0;
-        }
+    return true;
+}
+
+// The map format stores the width and height in tiles on 8 bits, a bigger map could never be loaded
+bool checkMapSize(const char *mapfile, MapImage mapImg)
+{
+    int W = mapImg.width/tileSize;
+    int H = mapImg.height/tileSize;
+    if ((W > MAP_MAX_SIZE) || (H > MAP_MAX_SIZE)) {
+        printf("\e[31mError: [%s] is %d*%d tiles, a map can be up to %d*%d\e[0m\n", mapfile, W, H, MAP_MAX_SIZE, MAP_MAX_SIZE);
+        return false;
     }
 
-    fclose(file);
+    return true;
 }
 
-void parsePixels(const char *filename, Image *img)
+// Tiles in reading order (left to right, top to bottom), as views into the image
+Tile *slicingTiles(MapImage *img)
 {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        printf("Error: Could not open file [%s]\n", filename);
-        return;
+    int tilesX = img->width / tileSize;
+    int tilesY = img->height / tileSize;
+
+    Tile *tiles = (Tile *)malloc(tilesX * tilesY * sizeof(Tile));
+    for (int ty = 0; ty < tilesY; ty++) {
+        for (int tx = 0; tx < tilesX; tx++) {
+            tiles[ty * tilesX + tx].PXS = &img->PXS[(ty * tileSize) * img->width + tx * tileSize];
+            tiles[ty * tilesX + tx].stride = img->width;
+        }
     }
 
-    int x, y;
-    char str[32];
-    uint32_t rgb;
-    while (!feof(file)) {
-        fscanf(file, "%dpx %dpx #%06X,", &x, &y, &rgb);
-        img->PXS[x][y].R = (rgb >> 16) & 0xFF;
-        img->PXS[x][y].G = (rgb >> 8) & 0xFF;
-        img->PXS[x][y].B = rgb & 0xFF;
-        // printf("px @ [%d, %d] : RGB(\e[31m%03u\e[0m,\e[32m%03u\e[0m,\e[34m%03u\e[0m) #%02x%02x%02x\n", x, y, img->PXS[x][y].R, img->PXS[x][y].G, img->PXS[x][y].B, img->PXS[x][y].R, img->PXS[x][y].G, img->PXS[x][y].B);
+    return tiles;
+}
+
+void freeImg(MapImage *img)
+{
+    MemFree(img->PXS);
+}
+
+void freeTiles(Tile *tiles)
+{
+    free(tiles);
+}
+
+// The rows of a tile are contiguous, so a tile comparison is one memcmp per row
+bool compareTileScalar(Tile mapTile, Tile tile)
+{
+    for (int y = 0; y < tileSize; y++) {
+        if (memcmp(mapTile.PXS + y * mapTile.stride, tile.PXS + y * tile.stride, tileSize * sizeof(Color)) != 0) {
+            return false;
+        }
     }
 
-    fclose(file);
+    return true;
 }
 
-void slicingTiles(Image *img, Pixel ****tiles)
+#ifdef MAPSCAN_X86
+// XORs every row 16 bytes at a time and only tests the accumulated difference once at the end,
+// a row of 8 RGBA pixels is 2 loads, the bytes left (tileSize not a multiple of 4) go through memcmp
+// (SSE2 is only baseline on x86_64, a 32-bit build needs the target attribute)
+__attribute__((target("sse2")))
+bool compareTileSSE2(Tile mapTile, Tile tile)
 {
-    int tilesX = img->width / tileSize;
-    int tilesY = img->height / tileSize;
-    int tilesNumber = tilesX * tilesY;
+    int rowBytes = tileSize * sizeof(Color);
+    int vectorBytes = rowBytes & ~15;
+    __m128i diff = _mm_setzero_si128();
+
+    for (int y = 0; y < tileSize; y++) {
+        const uint8_t *a = (const uint8_t *)(mapTile.PXS + y * mapTile.stride);
+        const uint8_t *b = (const uint8_t *)(tile.PXS + y * tile.stride);
+        for (int i = 0; i < vectorBytes; i += 16) {
+            __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+            __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+            diff = _mm_or_si128(diff, _mm_xor_si128(va, vb));
+        }
+        if ((vectorBytes < rowBytes) && (memcmp(a + vectorBytes, b + vectorBytes, rowBytes - vectorBytes) != 0)) {
+            return false;
+        }
+    }
 
-    *tiles = (Pixel ***)malloc(tilesNumber * sizeof(Pixel **));
-    for (int i = 0; i < tilesNumber; i++) {
-        (*tiles)[i] = (Pixel **)malloc(tileSize * sizeof(Pixel *));
-        for (int j = 0; j < tileSize; j++) {
-            (*tiles)[i][j] = (Pixel *)malloc(tileSize * sizeof(Pixel));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) == 0xFFFF;
+}
+
+// Same as compareTileSSE2() with 32 bytes at a time: a row of 8 RGBA pixels is a single load
+__attribute__((target("avx2")))
+bool compareTileAVX2(Tile mapTile, Tile tile)
+{
+    int rowBytes = tileSize * sizeof(Color);
+    int vectorBytes = rowBytes & ~31;
+    __m256i diff = _mm256_setzero_si256();
+
+    for (int y = 0; y < tileSize; y++) {
+        const uint8_t *a = (const uint8_t *)(mapTile.PXS + y * mapTile.stride);
+        const uint8_t *b = (const uint8_t *)(tile.PXS + y * tile.stride);
+        for (int i = 0; i < vectorBytes; i += 32) {
+            __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+            __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+            diff = _mm256_or_si256(diff, _mm256_xor_si256(va, vb));
+        }
+        if ((vectorBytes < rowBytes) && (memcmp(a + vectorBytes, b + vectorBytes, rowBytes - vectorBytes) != 0)) {
+            return false;
         }
     }
 
-    for (int ty = 0; ty < tilesY; ty++) {
-        for (int tx = 0; tx < tilesX; tx++) {
-            for (int x = 0; x < tileSize; x++) {
-                for (int y = 0; y < tileSize; y++) {
-                    (*tiles)[ty * tilesX + tx][x][y] = img->PXS[tx * tileSize + x][ty * tileSize + y];
-                }
+    return _mm256_testz_si256(diff, diff);
+}
+#endif
+
+// Picks the fastest tile comparison the CPU supports
+void selectCompareTile(void)
+{
+#ifdef MAPSCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        compareTile = compareTileAVX2;
+        compareTileName = "AVX2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        compareTile = compareTileSSE2;
+        compareTileName = "SSE2";
+    }
+#endif
+    printf("Tile comparison: %s\n", compareTileName);
+}
+
+// Times every available kernel on full-length comparisons (each tile with itself, as after a hash hit)
+void benchCompareTile(Tile *tiles, int Ntiles)
+{
+    struct {
+        const char *name;
+        bool (*compare)(Tile mapTile, Tile tile);
+    } kernels[] = {
+        {"scalar", compareTileScalar},
+#ifdef MAPSCAN_X86
+        {"SSE2", compareTileSSE2},
+        {"AVX2", compareTileAVX2},
+#endif
+    };
+
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+#ifdef MAPSCAN_X86
+        if ((kernels[k].compare == compareTileAVX2) && !__builtin_cpu_supports("avx2")) continue;
+#endif
+        struct timespec start, end;
+        long compares = 0;
+        volatile int matches = 0;
+        double elapsed = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (elapsed < 0.25) {    // seconds
+            for (int t = 0; t < Ntiles; t++) {
+                matches += kernels[k].compare(tiles[t], tiles[t]);
             }
+            compares += Ntiles;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        }
+
+        printf("%-8s %8.2f ns/tile  %10.1f Mtiles/s  %8.1f MB/s\n",
+            kernels[k].name,
+            elapsed * 1e9 / compares,
+            compares / elapsed / 1e6,
+            compares * 2.0 * tileSize * tileSize * sizeof(Color) / elapsed / 1e6
+        );
+    }
+}
+
+// FNV-1a over the RGBA pixels of the tile, a pixel at a time
+uint64_t hashTile(Tile tile)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (int y = 0; y < tileSize; y++) {
+        const Color *row = tile.PXS + y * tile.stride;
+        for (int x = 0; x < tileSize; x++) {
+            uint32_t px;
+            memcpy(&px, &row[x], sizeof(px));
+            hash = (hash ^ px) * 0x100000001b3ULL;
         }
     }
+
+    return hash;
+}
+
+// Makes an empty table for Ntiles tiles at most
+void makeTileTable(int Ntiles, TileTable *table)
+{
+    uint32_t size = 16;
+    while (size < 2 * (uint32_t)Ntiles) size *= 2;  // load factor <= 0.5
+
+    table->slots = (TileSlot *)malloc(size * sizeof(TileSlot));
+    table->mask = size - 1;
+    for (uint32_t i = 0; i < size; i++) {
+        table->slots[i].tile = -1;
+    }
+}
+
+void insertTile(TileTable *table, Tile *tiles, int t)
+{
+    uint64_t hash = hashTile(tiles[t]);
+    uint32_t i = hash & table->mask;
+    while (table->slots[i].tile != -1) {
+        i = (i + 1) & table->mask;
+    }
+    table->slots[i].hash = hash;
+    table->slots[i].tile = t;
 }
 
-void freeImg(Image *img)
+// Hashes every tileset tile once, a tile identical to a previous one is skipped so the lowest index wins
+void buildTileTable(Tile *tiles, int Ntiles, TileTable *table)
 {
-    for (int i = 0; i < img->width; i++) {
-        free(img->PXS[i]);
+    makeTileTable(Ntiles, table);
+
+    for (int t = 0; t < Ntiles; t++) {
+        if (findTile(table, tiles, tiles[t]) != -1) continue;   // duplicate tile
+        insertTile(table, tiles, t);
     }
-    free(img->PXS);
 }
 
-void freeTiles(int width, int height, Pixel ***tiles)
+// Returns the tileset index of the tile, or -1, the pixels are only compared on a hash hit
+int findTile(TileTable *table, Tile *tiles, Tile mapTile)
 {
-    int tilesX = width / tileSize;
-    int tilesY = height / tileSize;
-    int tilesNumber = tilesX * tilesY;
+    uint64_t hash = hashTile(mapTile);
+    uint32_t i = hash & table->mask;
 
-    for (int i = 0; i < tilesNumber; i++) {
-        for (int j = 0; j < tileSize; j++) {
-            free(tiles[i][j]);
+    while (table->slots[i].tile != -1) {
+        if ((table->slots[i].hash == hash) && compareTile(mapTile, tiles[table->slots[i].tile])) {
+            return table->slots[i].tile;
         }
-        free(tiles[i]);
+        i = (i + 1) & table->mask;
     }
-    free(tiles);
+
+    return -1;
 }
 
-bool compareTile(Pixel **mapPX, Pixel **tilePX)
+void freeTileTable(TileTable *table)
 {
-    int match = 0;
+    free(table->slots);
+}
 
-    for (int x = 0; x < tileSize; x++) {
-        for (int y = 0; y < tileSize; y++) {
-            // printf("map [%d, %d] RGB(\e[31m%03u\e[0m,\e[32m%03u\e[0m,\e[34m%03u\e[0m) #%02x%02x%02x\n", x, y, mapPX[x][y].R, mapPX[x][y].G, mapPX[x][y].B, mapPX[x][y].R, mapPX[x][y].G, mapPX[x][y].B);
-            // printf("tile[%d, %d] RGB(\e[31m%03u\e[0m,\e[32m%03u\e[0m,\e[34m%03u\e[0m) #%02x%02x%02x ", x, y, tilePX[x][y].R, tilePX[x][y].G, tilePX[x][y].B, tilePX[x][y].R, tilePX[x][y].G, tilePX[x][y].B);
-
-            if ((mapPX[x][y].R == tilePX[x][y].R) &&
-                (mapPX[x][y].G == tilePX[x][y].G) &&
-                (mapPX[x][y].B == tilePX[x][y].B)) {
-                    match++;
-                    //printf("\e[32mokay\e[0m\n\n");
-                    //printf("█");
-            } else {
-                //printf("\e[31mnuh huh\e[0m\n\n");
-                //printf("░");
-                return false;
-            }
+// Every map tile lookup is independent: the rows are split between the jobs, each one writes
+// the indices of its rows into the returned array (-1 for no match), in map order
+int *compareMap(Tile *map, Tile *tiles, TileTable *table, int Nmap, MapImage img, int jobs)
+{
+    int W = img.width/tileSize;
+    int H = Nmap / W;
+    if (jobs > H) jobs = H;
+    if (jobs < 1) jobs = 1;
+
+    int *indices = (int *)malloc(Nmap * sizeof(int));
+    atomic_int rowsDone = 0;
+    atomic_int percent = -1;
+    MatchJob *workers = (MatchJob *)malloc(jobs * sizeof(MatchJob));
+    for (int j = 0; j < jobs; j++) {
+        workers[j] = (MatchJob) {
+            .map = map,
+            .tiles = tiles,
+            .table = table,
+            .indices = indices,
+            .W = W,
+            .firstRow = H * j / jobs,
+            .lastRow = H * (j + 1) / jobs,
+            .H = H,
+            .rowsDone = &rowsDone,
+            .percent = &percent,
+        };
+    }
+    // the calling thread takes the first rows itself
+    for (int j = 1; j < jobs; j++) {
+        workers[j].started = (pthread_create(&workers[j].thread, NULL, matchRows, &workers[j]) == 0);
+        if (!workers[j].started) {
+            printf("Error: Could not start job %d, matching its rows here\n", j);
+            matchRows(&workers[j]);
         }
-        //putchar('\n');
     }
-    if (match == tileSize * tileSize) { // all the pixel matched
-        return true;
+    matchRows(&workers[0]);
+    for (int j = 1; j < jobs; j++) {
+        if (workers[j].started) pthread_join(workers[j].thread, NULL);
     }
 
-    return false;
+    printf("\n");
+
+    free(workers);
+    return indices;
 }
 
-void compareMap(Pixel ***map, Pixel ***tiles, int Nmap, int Ntiles, Image img, const char *outputfile)
+// Builds the tileset from the map itself: every map tile is looked up among the unique tiles found
+// so far and added when it is new, then the unique tiles are packed TILESET_COLUMNS per row
+// Nothing is written if the map has more unique tiles than a map can use, returns false then
+bool extractTileset(Tile *map, int Nmap, MapImage mapImg, const char *tilesetfile, const char *outputfile, bool flips)
 {
-    int W = img.width/tileSize;
-    FILE *output = fopen(outputfile, "a");    // append
+    int *indices = (int *)malloc(Nmap * sizeof(int));
+    int *uses = (int *)calloc(Nmap, sizeof(int));
+    Tile *unique = (Tile *)malloc(Nmap * sizeof(Tile));
+    int Nunique = 0;
+
+    TileTable table;
+    makeTileTable(Nmap, &table);
+    for (int tmap = 0; tmap < Nmap; tmap++) {
+        int t = findTile(&table, unique, map[tmap]);
+        if (t == -1) {
+            t = Nunique++;
+            unique[t] = map[tmap];
+            insertTile(&table, unique, t);
+        }
+        indices[tmap] = t;
+        uses[t]++;
+    }
 
-    for (int tmap = 0; tmap < Nmap; tmap++) { // {0..8640}
-        printf("\e[35mTesting map[%04d]\e[0m\n", tmap);
-        for (int t = 0; t < Ntiles; t++) {    // {0...103}
-            printf("\e[33m> with tileset[%03d]\e[0m ", t);
-            if (compareTile(map[tmap], tiles[t]) == true) {
-                printf("\e[32mmatch !\e[0m [%04d][%03d]\n", tmap, t);
-                fprintf(output, "%03d ", t);
-                t = 0;
-                break;
-            } else {
-                printf("\e[31mno match\e[0m\n");
+    bool extracted = (Nunique <= TILESET_MAX_TILES);
+    if (!extracted) {
+        printf("\e[31mError: %d unique tiles, a map can only use %d, nothing written\e[0m\n", Nunique, TILESET_MAX_TILES);
+        freeTileTable(&table);
+        free(unique);
+        free(uses);
+        free(indices);
+        return false;
+    }
+
+    // Pack the unique tiles into the tileset image
+    int columns = (Nunique < TILESET_COLUMNS) ? Nunique : TILESET_COLUMNS;
+    int rows = (Nunique + columns - 1) / columns;
+    MapImage tilesetImg = {
+        .PXS = (Color *)calloc(columns * tileSize * rows * tileSize, sizeof(Color)),
+        .width = columns * tileSize,
+        .height = rows * tileSize,
+        .tilesNumber = Nunique,
+    };
+    for (int t = 0; t < Nunique; t++) {
+        Color *dst = &tilesetImg.PXS[(t / columns) * tileSize * tilesetImg.width + (t % columns) * tileSize];
+        for (int y = 0; y < tileSize; y++) {
+            memcpy(dst + y * tilesetImg.width, unique[t].PXS + y * unique[t].stride, tileSize * sizeof(Color));
+        }
+    }
+    Image image = {
+        .data = tilesetImg.PXS,
+        .width = tilesetImg.width,
+        .height = tilesetImg.height,
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+    };
+    if (!ExportImage(image, tilesetfile)) {
+        printf("Error: Could not write [%s]\n", tilesetfile);
+        extracted = false;
+    } else {
+        extracted = writeMap(mapImg, tilesetImg, tilesetfile, indices, outputfile);
+    }
+
+    // Reuse statistics
+    int once = 0, mostUsed = 0;
+    for (int t = 0; t < Nunique; t++) {
+        if (uses[t] == 1) once++;
+        if (uses[t] > uses[mostUsed]) mostUsed = t;
+    }
+    printf("[%s] %d map tiles -> %d unique tiles (%.1f uses per tile), %d used once, tile %03d used %d times\n",
+        tilesetfile, Nmap, Nunique, (float)Nmap / Nunique, once, mostUsed, uses[mostUsed]);
+    printf("[%s] is %d*%d px (%d KiB in RGBA), the map is %d*%d px (%d KiB)\n",
+        tilesetfile, tilesetImg.width, tilesetImg.height, tilesetImg.width * tilesetImg.height * 4 / 1024,
+        mapImg.width, mapImg.height, mapImg.width * mapImg.height * 4 / 1024);
+
+    // The map format has no flip bits, so the mirrored tiles stay in the tileset, they are only counted
+    if (flips) {
+        Color *PXS = (Color *)malloc(tileSize * tileSize * sizeof(Color));
+        Tile flipped = { PXS, tileSize };
+        int mirrors = 0;
+        for (int t = 0; t < Nunique; t++) {
+            for (int f = 1; f < 4; f++) {   // horizontal, vertical, both
+                flipTile(unique[t], PXS, f & 1, f & 2);
+                int m = findTile(&table, unique, flipped);
+                if ((m != -1) && (m < t)) {
+                    mirrors++;
+                    break;
+                }
             }
         }
-        if ((tmap + 1) % W == 0)
-            fprintf(output, "\n");
+        printf("[%s] %d unique tiles are a mirror of another one (%d tiles with flip bits)\n",
+            tilesetfile, mirrors, Nunique - mirrors);
+        free(PXS);
+    }
+
+    freeTileTable(&table);
+    free(tilesetImg.PXS);
+    free(unique);
+    free(uses);
+    free(indices);
+    return extracted;
+}
+
+// Copies the tile mirrored into PXS (tileSize*tileSize pixels)
+void flipTile(Tile tile, Color *PXS, bool horizontal, bool vertical)
+{
+    for (int y = 0; y < tileSize; y++) {
+        const Color *row = tile.PXS + (vertical ? tileSize - 1 - y : y) * tile.stride;
+        for (int x = 0; x < tileSize; x++) {
+            PXS[y * tileSize + x] = row[horizontal ? tileSize - 1 - x : x];
+        }
     }
 }
 
-void writePNG(Image mapImg, Image tilesetImg, const char *tilesetfile, const char *outputfile)
+// The tile table and the tiles are only read, so the jobs share them without locking
+void *matchRows(void *arg)
 {
+    MatchJob *job = (MatchJob *)arg;
+
+    for (int row = job->firstRow; row < job->lastRow; row++) {
+        for (int tmap = row * job->W; tmap < (row + 1) * job->W; tmap++) {
+            job->indices[tmap] = findTile(job->table, job->tiles, job->map[tmap]);
+        }
+
+        // only the job that crosses a new percent prints it
+        int done = atomic_fetch_add(job->rowsDone, 1) + 1;
+        int percent = done * 100 / job->H;
+        int last = atomic_load(job->percent);
+        if ((percent > last) && atomic_compare_exchange_strong(job->percent, &last, percent)) {
+            printf("\rMatching the map tiles... %3d%%", percent);
+            fflush(stdout);
+        }
+    }
+
+    return NULL;
+}
+
+// Formats the whole .dat in memory and writes it at once
+// Returns false if a map tile is not in the tileset or the .dat could not be written, no .dat is left
+// behind then so the batch mode converts the map again next time
+bool writeMap(MapImage mapImg, MapImage tilesetImg, const char *tilesetfile, int *indices, const char *outputfile)
+{
+    int W = mapImg.width/tileSize;
+    int H = mapImg.height/tileSize;
+    int Nmap = W * H;
+
     // Allocate memory for the tileset filename with .png extension
     size_t tilesetfile_length = strlen(tilesetfile);
     char *tilesetfile_png = (char *)malloc(tilesetfile_length + 1); // +1 for null terminator
 
     if (!tilesetfile_png) {
         perror("Failed to allocate memory");
-        return;
+        return false;
     }
 
-    // Copy the tileset filename and replace .css with .png
+    // Copy the tileset filename and make sure it ends with .png
     strcpy(tilesetfile_png, tilesetfile);
     char *extension = strrchr(tilesetfile_png, '.');
     if (extension) {
         strcpy(extension, ".png");
     }
 
-    FILE *output = fopen(outputfile, "w");
+    // header, then "%03d " per tile (up to 5 digits in a big tileset) and a newline per row
+    size_t capacity = 64 + tilesetfile_length + 32 + Nmap * 6 + H;
+    char *buffer = (char *)malloc(capacity);
+    size_t size = snprintf(buffer, capacity, "%03d %03d %03d %03d %03d\n", W, H, tilesetImg.tilesNumber, tileSize, 1);
+    size += snprintf(buffer + size, capacity - size, "assets/sprites/tilesets/%s\n", tilesetfile_png);
+    free(tilesetfile_png);
+
+    int unmatched = 0;
+    for (int tmap = 0; tmap < Nmap; tmap++) { // {0..8640}
+        int t = indices[tmap];
+        if (verbose) {
+            if (t != -1) {
+                printf("\e[35mTesting map[%04d]\e[0m \e[32mmatch !\e[0m [%04d][%03d]\n", tmap, tmap, t);
+            } else {
+                printf("\e[35mTesting map[%04d]\e[0m \e[31mno match\e[0m\n", tmap);
+            }
+        }
+        if (t == -1) {
+            unmatched++;
+            continue;
+        }
+        if (t < 1000) {
+            buffer[size++] = '0' + t / 100;
+            buffer[size++] = '0' + t / 10 % 10;
+            buffer[size++] = '0' + t % 10;
+        } else {
+            size += snprintf(buffer + size, capacity - size, "%d", t);
+        }
+        buffer[size++] = ' ';
+        if ((tmap + 1) % W == 0)
+            buffer[size++] = '\n';
+    }
+
+    if (unmatched > 0) {
+        printf("\e[31mError: %d map tiles are not in the tileset, nothing written, try -x to make the tileset from the map\e[0m\n", unmatched);
+        remove(outputfile);     // an older .dat would look up to date
+        free(buffer);
+        return false;
+    }
+
+    bool written = false;
+    FILE *output = fopen(outputfile, "wb");
     if (!output) {
         printf("Error: Could not open file [%s]\n", outputfile);
-        free(tilesetfile_png);
-        return;
+    } else {
+        written = (fwrite(buffer, 1, size, output) == size);
+        if (!written) {
+            printf("Error: Could not write file [%s]\n", outputfile);
+        }
+        fclose(output);
+        if (!written) remove(outputfile);
     }
+    free(buffer);
 
-    fprintf(output, "%03d %03d %03d %03d %03d\n", mapImg.width/tileSize, mapImg.height/tileSize, tilesetImg.tilesNumber, tileSize, 1);
-    fprintf(output, "assets/sprites/tilesets/%s\n", tilesetfile_png);
-    fclose(output);
-    free(tilesetfile_png);
+    return written;
+}
+
+// Converts every map of <mapsdir>/maps.txt, the tilesets are loaded and hashed once for all the maps
+// that share them, and a map is skipped when its .dat is newer than the map and its tileset
+// Returns the number of maps that could not be converted
+int batchConvert(const char *mapsdir, const char *tilesetsdir, const char *outputdir, int jobs)
+{
+    char listfile[512];
+    snprintf(listfile, sizeof(listfile), "%s/maps.txt", mapsdir);
+    FILE *list = fopen(listfile, "r");
+    if (!list) {
+        printf("Error: Could not open file [%s]\n", listfile);
+        return 1;
+    }
+
+    Tileset *tilesets = NULL;
+    int Ntilesets = 0;
+    int converted = 0, skipped = 0, failed = 0;
+
+    char line[768];
+    for (int lineNumber = 1; fgets(line, sizeof(line), list); lineNumber++) {
+        char map[256], tilesetname[256];
+        int size;
+        if ((line[strspn(line, " \t\r\n")] == '\0') || (line[strspn(line, " \t")] == '#')) continue;
+        if ((sscanf(line, "%255s %255s %d", map, tilesetname, &size) != 3) || (size <= 0) || (size > MAP_MAX_SIZE)) {
+            printf("Error: [%s:%d] expected \"<map>.png <tileset>.png <tile size>\"\n", listfile, lineNumber);
+            failed++;
+            continue;
+        }
+
+        char mapfile[512], tilesetfile[512], outputfile[512];
+        snprintf(mapfile, sizeof(mapfile), "%s/%s", mapsdir, map);
+        snprintf(tilesetfile, sizeof(tilesetfile), "%s/%s", tilesetsdir, tilesetname);
+        char *extension = strrchr(map, '.');
+        if (extension) *extension = '\0';
+        snprintf(outputfile, sizeof(outputfile), "%s/%s.dat", outputdir, map);
+
+        if (isUpToDate(outputfile, mapfile, tilesetfile)) {
+            skipped++;
+            continue;
+        }
+
+        tileSize = size;
+        Tileset *tileset = loadTileset(&tilesets, &Ntilesets, tilesetfile);
+        if (!tileset || !convertMap(mapfile, tileset, tilesetname, outputfile, jobs)) {
+            failed++;
+            continue;
+        }
+        converted++;
+    }
+    fclose(list);
+
+    for (int i = 0; i < Ntilesets; i++) {
+        freeTileTable(&tilesets[i].table);
+        freeTiles(tilesets[i].tiles);
+        freeImg(&tilesets[i].img);
+    }
+    free(tilesets);
+
+    printf("%d maps converted, %d up to date, %d failed (%d tilesets loaded)\n", converted, skipped, failed, Ntilesets);
+    return failed;
+}
+
+bool isNewer(struct timespec a, struct timespec b)
+{
+    return (a.tv_sec > b.tv_sec) || ((a.tv_sec == b.tv_sec) && (a.tv_nsec > b.tv_nsec));
+}
+
+// A missing file is never up to date
+bool isUpToDate(const char *outputfile, const char *mapfile, const char *tilesetfile)
+{
+    struct stat output, map, tileset;
+    if ((stat(outputfile, &output) != 0) || (stat(mapfile, &map) != 0) || (stat(tilesetfile, &tileset) != 0)) {
+        return false;
+    }
+
+    return !isNewer(map.st_mtim, output.st_mtim) && !isNewer(tileset.st_mtim, output.st_mtim);
+}
+
+// Returns the tileset from the ones already loaded (with the current tileSize), or loads it
+Tileset *loadTileset(Tileset **tilesets, int *Ntilesets, const char *path)
+{
+    for (int i = 0; i < *Ntilesets; i++) {
+        if ((strcmp((*tilesets)[i].path, path) == 0) && ((*tilesets)[i].tileSize == tileSize)) {
+            return &(*tilesets)[i];
+        }
+    }
+
+    MapImage img;
+    if (!loadImage(path, &img)) return NULL;
+
+    *tilesets = (Tileset *)realloc(*tilesets, (*Ntilesets + 1) * sizeof(Tileset));
+    Tileset *tileset = &(*tilesets)[(*Ntilesets)++];
+    snprintf(tileset->path, sizeof(tileset->path), "%s", path);
+    tileset->tileSize = tileSize;
+    tileset->img = img;
+    tileset->tiles = slicingTiles(&tileset->img);
+    buildTileTable(tileset->tiles, tileset->img.tilesNumber, &tileset->table);
+
+    return tileset;
+}
+
+bool convertMap(const char *mapfile, Tileset *tileset, const char *tilesetname, const char *outputfile, int jobs)
+{
+    if (tileset->img.tilesNumber > TILESET_MAX_TILES) {
+        printf("\e[31mError: [%s] has %d tiles, a map can only use %d\e[0m\n", tileset->path, tileset->img.tilesNumber, TILESET_MAX_TILES);
+        return false;
+    }
+
+    MapImage mapImg;
+    if (!loadImage(mapfile, &mapImg)) return false;
+    if (!checkMapSize(mapfile, mapImg)) {
+        freeImg(&mapImg);
+        return false;
+    }
+
+    Tile *mapTiles = slicingTiles(&mapImg);
+    int *indices = compareMap(mapTiles, tileset->tiles, &tileset->table, mapImg.tilesNumber, mapImg, jobs);
+    bool written = writeMap(mapImg, tileset->img, tilesetname, indices, outputfile);
+    free(indices);
+
+    freeTiles(mapTiles);
+    freeImg(&mapImg);
+    return written;
 }